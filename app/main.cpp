@@ -1,29 +1,56 @@
 #include "Fec_Encoder.h"
+#include "Mux.h"
+#include "Static_Fec_Encoder.h"
 #include "Phy.h"
+#include "Pacer.h"
+#include "Compressor.h"
 #include "utils/pigpio.h"
+#include "utils/chacha20_poly1305.h"
 #include <iostream>
 #include <string>
+#include <random>
+#include <thread>
+#include <atomic>
+#include <deque>
 #include <cstdio>
+#include <cstring>
 #include <sys/select.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <climits>
+#include <cerrno>
 #include <fcntl.h>
+#include <poll.h>
 #include <unistd.h>
 
 bool s_verbose = false;
 bool s_flush = false;
 
 bool s_fec_benchmark = false;
+bool s_fec_benchmark_static = false;
+bool s_fec_benchmark_sync = false;
 bool s_phy_benchmark = false;
 bool s_use_fec = false;
 uint32_t s_fec_coding_k = 0;
 uint32_t s_fec_coding_n = 0;
+size_t s_fec_interleaving_depth = 1;
+size_t s_fec_spread = 0;
+bool s_fec_drop_oldest = false;
+bool s_fec_checksum = false;
+size_t s_fec_max_hold_ms = 0;
+bool s_fec_unordered = false;
+
+float s_fec_benchmark_burst_rate = 0.f;
+size_t s_fec_benchmark_burst_length = 0;
+size_t s_fec_benchmark_receivers = 1;
 
 const size_t MAX_MTU = Phy::MAX_PAYLOAD_SIZE - Fec_Encoder::PAYLOAD_OVERHEAD;
 size_t s_mtu = MAX_MTU;
 
 bool s_use_spi_dev = true;
 std::string s_spi_dev = "/dev/spidev0.0";
+std::vector<std::string> s_rx_spi_devs;
 size_t s_pigpio_spi_port = 0;
 size_t s_pigpio_spi_channel = 0;
 size_t s_spi_speed = 8000000;
@@ -31,6 +58,15 @@ size_t s_spi_delay = 20;
 Phy::Rate s_phy_rate = Phy::Rate::RATE_B_5_5M_CCK;
 float s_phy_power = 20.5f;
 uint8_t s_phy_channel = 1;
+bool s_tx_pacing = false;
+bool s_tx_credits = false;
+size_t s_tx_credits_max_wait_ms = 0;
+bool s_tx_credits_benchmark = false;
+bool s_compress = false;
+std::string s_control_in;
+std::string s_control_out;
+std::vector<uint8_t> s_encryption_key;
+bool s_crypto_benchmark = false;
 
 /* This prints an "Assertion failed" message and aborts.  */
 void __assert_fail(const char *__assertion, const char *__file, unsigned int __line, const char *__function)
@@ -46,14 +82,36 @@ void show_help()
     std::cout << "Usage:\n";
     std::cout << "\t--hrlp\tShows this help message\n";
     std::cout << "\t--fec-benchmark\tRuns a FEC benchmark\n";
+    std::cout << "\t--fec-benchmark-static\tRuns the FEC benchmark with the compile time configured encoder (K 12, N 20, max mtu)\n";
+    std::cout << "\t--fec-benchmark-sync\tRuns the FEC benchmark with synchronous encoders, without the coding threads\n";
+    std::cout << "\t--fec-benchmark-loss RATE LENGTH\tSimulate burst losses in the FEC benchmark.\n";
+    std::cout << "\t\tEvery packet starts a burst of LENGTH lost packets with probability RATE (0 - 1)\n";
+    std::cout << "\t--fec-benchmark-receivers COUNT\tSimulate COUNT diversity receivers in the FEC benchmark, each with its own losses\n";
     std::cout << "\t--phy-benchmark\tRuns a PHY bandwidth benchmark\n";
     std::cout << "\t--verbose\tPrint out the settings\n";
     std::cout << "\t--flush\tFlush stdout when writing to it. This can reduce latency\n";
     std::cout << "\t--fec K N\tUse FEC (Forward Error Correction) for transmission and reception\n";
     std::cout << "\t\tK and N are the coding constants. Every K packets, N are produced (N > K)\n";
+    std::cout << "\t\tThey are sent along with the data so the receiver follows whatever the transmitter uses\n";
+    std::cout << "\t--fec-interleave D\tSend the datagrams of D consecutive FEC blocks round-robin to survive longer burst losses.\n";
+    std::cout << "\t\tBoth ends have to use the same value\n";
+    std::cout << "\t--fec-spread P\tSend the FEC datagrams of a block one every P packets of the next block instead of all at once\n";
+    std::cout << "\t--fec-max-hold MS\tGive up on an incomplete FEC block once the next one has been waiting for MS milliseconds.\n";
+    std::cout << "\t\tThis bounds the latency after losses, otherwise a block is given up on only when enough newer ones come in\n";
+    std::cout << "\t--fec-drop-oldest\tWhen the data comes in faster than it can be sent, drop the oldest queued data instead of blocking. For live streams\n";
+    std::cout << "\t--fec-checksum\tAdd a CRC32C to every FEC datagram so the receiver drops the corrupted ones instead of decoding with them\n";
+    std::cout << "\t--fec-unordered\tOutput every received packet right away instead of in order, the recovered ones follow later.\n";
+    std::cout << "\t\tFor data that doesn't need the order (timestamped samples), it cuts the latency after losses\n";
+    std::cout << "\t--encrypt KEY\tEncrypt and authenticate the FEC datagrams with ChaCha20-Poly1305. KEY is 64 hex digits, both ends have to use the same one\n";
+    std::cout << "\t--crypto-benchmark\tMeasures the ChaCha20-Poly1305 throughput\n";
+    std::cout << "\t--compress\tCompress the data with zlib before FEC. Both ends have to use it\n";
+    std::cout << "\t--control-stream IN OUT\tAlso send what's written in the IN fifo on a second, small FEC stream sent ahead of the data\n";
+    std::cout << "\t\tand append what's received on it to the OUT file. For control and telemetry messages. Needs --fec\n";
     std::cout << "\t--mtu " << std::to_string(s_mtu) << "\tUse the specified packet size. Max is " << std::to_string(MAX_MTU) << "\n";
     std::cout << "\t--spi-dev \"/dev/spidev0.0\"\tUse the specified device for SPI\n";
     std::cout << "\t--spi-pigpio PORT CHANNEL\tUse PIGPIO on the specified port & channel for SPI\n";
+    std::cout << "\t--rx-spi-dev \"/dev/spidev0.1\"\tAlso receive through the esp8266 on this SPI device, merged into the same FEC decoder.\n";
+    std::cout << "\t\tCan be repeated. More receivers with different antennas or orientations lose less\n";
     std::cout << "\t--spi-speed 8000000 \tUse the specified SPI speed (Hz)\n";
     std::cout << "\t--spi-delay 20\tUse the specified delay in microseconds for SPI transactions\n";
     std::cout << "\t--phy-rate X\tThe PHY rate index, out of these values:\n";
@@ -74,6 +132,10 @@ void show_help()
     std::cout << "\t\t14: 802.11g 56Mbps, ODFM modulation\n";
     std::cout << "\t--phy-power X\tThe PHY power in dBm between 0dBm to 20.5dBm\n";
     std::cout << "\t--phy-channel X\tThe PHY channel between 1 and 11\n";
+    std::cout << "\t--tx-pacing\tPace the packets sent to the esp8266 based on the PHY rate so its queue doesn't overflow\n";
+    std::cout << "\t--tx-credits MAX_WAIT_MS\tWait for room in the esp8266 queue, as reported by the firmware, before sending.\n";
+    std::cout << "\t\tPackets that don't get room within MAX_WAIT_MS are dropped here. 0 waits forever\n";
+    std::cout << "\t--tx-credits-benchmark\tSends to an emulation of the firmware queue with and without TX credits and reports the drops\n";
 }
 
 int parse_arguments(int argc, const char* argv[])
@@ -92,6 +154,47 @@ int parse_arguments(int argc, const char* argv[])
         {
             s_fec_benchmark = true;
         }
+        else if (arg == "--fec-benchmark-static")
+        {
+            s_fec_benchmark = true;
+            s_fec_benchmark_static = true;
+        }
+        else if (arg == "--fec-benchmark-sync")
+        {
+            s_fec_benchmark = true;
+            s_fec_benchmark_sync = true;
+        }
+        else if (arg == "--fec-benchmark-loss")
+        {
+            if (remanining < 2)
+            {
+                std::cerr << arg << " has to be followed by the burst rate and length\n";
+                return -1;
+            }
+            s_fec_benchmark_burst_rate = std::stof(argv[i + 1]);
+            s_fec_benchmark_burst_length = std::stoul(argv[i + 2]);
+            if (s_fec_benchmark_burst_rate < 0.f || s_fec_benchmark_burst_rate > 1.f)
+            {
+                std::cerr << "Invalid burst rate: " << std::to_string(s_fec_benchmark_burst_rate) << "\n";
+                return -1;
+            }
+            i += 2;
+        }
+        else if (arg == "--fec-benchmark-receivers")
+        {
+            if (remanining == 0)
+            {
+                std::cerr << arg << " has to be followed by the receiver count\n";
+                return -1;
+            }
+            s_fec_benchmark_receivers = std::stoul(argv[i + 1]);
+            if (s_fec_benchmark_receivers == 0 || s_fec_benchmark_receivers > Fec_Encoder::MAX_RECEIVERS)
+            {
+                std::cerr << "Invalid receiver count: " << std::to_string(s_fec_benchmark_receivers) << "\n";
+                return -1;
+            }
+            i++;
+        }
         else if (arg == "--phy-benchmark")
         {
             s_phy_benchmark = true;
@@ -122,6 +225,92 @@ int parse_arguments(int argc, const char* argv[])
             s_use_fec = true;
             i += 2;
         }
+        else if (arg == "--fec-interleave")
+        {
+            if (remanining == 0)
+            {
+                std::cerr << arg << " has to be followed by a numeric value > 0 && <= " << std::to_string(Fec_Encoder::MAX_INTERLEAVING_DEPTH) << "\n";
+                return -1;
+            }
+            s_fec_interleaving_depth = std::stoul(argv[i + 1]);
+            if (s_fec_interleaving_depth == 0 || s_fec_interleaving_depth > Fec_Encoder::MAX_INTERLEAVING_DEPTH)
+            {
+                std::cerr << "Invalid interleaving depth: " << std::to_string(s_fec_interleaving_depth) << "\n";
+                return -1;
+            }
+            i++;
+        }
+        else if (arg == "--fec-spread")
+        {
+            if (remanining == 0)
+            {
+                std::cerr << arg << " has to be followed by a numeric value\n";
+                return -1;
+            }
+            s_fec_spread = std::stoul(argv[i + 1]);
+            i++;
+        }
+        else if (arg == "--fec-max-hold")
+        {
+            if (remanining == 0)
+            {
+                std::cerr << arg << " has to be followed by a numeric value\n";
+                return -1;
+            }
+            s_fec_max_hold_ms = std::stoul(argv[i + 1]);
+            i++;
+        }
+        else if (arg == "--fec-drop-oldest")
+        {
+            s_fec_drop_oldest = true;
+        }
+        else if (arg == "--fec-checksum")
+        {
+            s_fec_checksum = true;
+        }
+        else if (arg == "--fec-unordered")
+        {
+            s_fec_unordered = true;
+        }
+        else if (arg == "--encrypt")
+        {
+            if (remanining == 0)
+            {
+                std::cerr << arg << " has to be followed by the key\n";
+                return -1;
+            }
+            std::string key = argv[i + 1];
+            if (key.size() != Fec_Encoder::ENCRYPTION_KEY_SIZE * 2 || key.find_first_not_of("0123456789abcdefABCDEF") != std::string::npos)
+            {
+                std::cerr << "The key has to be " << std::to_string(Fec_Encoder::ENCRYPTION_KEY_SIZE * 2) << " hex digits\n";
+                return -1;
+            }
+            s_encryption_key.clear();
+            for (size_t j = 0; j < key.size(); j += 2)
+            {
+                s_encryption_key.push_back(static_cast<uint8_t>(std::stoul(key.substr(j, 2), nullptr, 16)));
+            }
+            i++;
+        }
+        else if (arg == "--crypto-benchmark")
+        {
+            s_crypto_benchmark = true;
+        }
+        else if (arg == "--compress")
+        {
+            s_compress = true;
+        }
+        else if (arg == "--control-stream")
+        {
+            if (remanining < 2)
+            {
+                std::cerr << arg << " has to be followed by the input and output paths\n";
+                return -1;
+            }
+            s_control_in = argv[i + 1];
+            s_control_out = argv[i + 2];
+            i += 2;
+        }
         else if (arg == "--mtu")
         {
             if (remanining == 0)
@@ -148,6 +337,21 @@ int parse_arguments(int argc, const char* argv[])
             s_spi_dev = argv[i + 1];
             i++;
         }
+        else if (arg == "--rx-spi-dev")
+        {
+            if (remanining == 0)
+            {
+                std::cerr << arg << " has to be followed by a device name\n";
+                return -1;
+            }
+            if (s_rx_spi_devs.size() + 1 >= Fec_Encoder::MAX_RECEIVERS)
+            {
+                std::cerr << "At most " << std::to_string(Fec_Encoder::MAX_RECEIVERS) << " receivers are supported\n";
+                return -1;
+            }
+            s_rx_spi_devs.push_back(argv[i + 1]);
+            i++;
+        }
         else if (arg == "--spi-pigpio")
         {
             if (remanining < 2)
@@ -206,6 +410,25 @@ int parse_arguments(int argc, const char* argv[])
             s_phy_power = std::stof(argv[i + 1]);
             i++;
         }
+        else if (arg == "--tx-pacing")
+        {
+            s_tx_pacing = true;
+        }
+        else if (arg == "--tx-credits")
+        {
+            if (remanining == 0)
+            {
+                std::cerr << arg << " has to be followed by a numeric value\n";
+                return -1;
+            }
+            s_tx_credits = true;
+            s_tx_credits_max_wait_ms = std::stoul(argv[i + 1]);
+            i++;
+        }
+        else if (arg == "--tx-credits-benchmark")
+        {
+            s_tx_credits_benchmark = true;
+        }
         else if (arg == "--phy-channel")
         {
             if (remanining == 0)
@@ -227,68 +450,169 @@ int parse_arguments(int argc, const char* argv[])
 }
 
 
-int run_fec_benchmark()
+//the synchronous Fec_Encoder has to be given time for its timeouts, the others don't
+inline void process_fec(Fec_Encoder& encoder)
 {
-    Fec_Encoder tx;
-    Fec_Encoder rx;
+    encoder.process();
+}
+template <typename Encoder> void process_fec(Encoder& encoder)
+{
+}
 
-    Fec_Encoder::TX_Descriptor tx_descriptor;
-    tx_descriptor.coding_k = s_fec_coding_k;
-    tx_descriptor.coding_n = s_fec_coding_n;
-    tx_descriptor.mtu = s_mtu;
-    if (!tx.init_tx(tx_descriptor))
+//only Fec_Encoder merges several receivers
+inline void add_fec_rx_packet(Fec_Encoder& rx, void const* data, size_t size, size_t receiver, int rssi)
+{
+    rx.add_rx_packet(data, size, true, receiver, rssi);
+}
+template <typename Encoder> void add_fec_rx_packet(Encoder& rx, void const* data, size_t size, size_t receiver, int rssi)
+{
+    rx.add_rx_packet(data, size, true);
+}
+
+//only Fec_Encoder keeps stats
+inline void print_fec_stats(Fec_Encoder const& rx)
+{
+    Fec_Encoder::Stats stats = rx.get_stats();
+    std::cout << "Blocks:\n";
+    std::cout << "\t" << std::to_string(stats.blocks_complete) << " complete, " << std::to_string(stats.blocks_recovered) << " recovered, " <<
+                 std::to_string(stats.blocks_skipped) << " skipped\n";
+    std::cout << "\tFEC datagrams used:";
+    for (size_t i = 1; i < stats.fec_used_histogram.size(); i++)
     {
-        return -1;
+        if (stats.fec_used_histogram[i] > 0)
+        {
+            std::cout << " " << std::to_string(i) << ": " << std::to_string(stats.fec_used_histogram[i]);
+        }
     }
+    std::cout << "\n";
 
-    Fec_Encoder::RX_Descriptor rx_descriptor;
-    rx_descriptor.coding_k = s_fec_coding_k;
-    rx_descriptor.coding_n = s_fec_coding_n;
-    rx_descriptor.mtu = s_mtu;
-    if (!rx.init_rx(rx_descriptor))
+    auto print_histogram = [](char const* name, std::array<size_t, Fec_Encoder::HISTOGRAM_SIZE> const& histogram)
     {
-        return -1;
+        std::cout << "\t" << name << ":";
+        for (size_t i = 0; i < histogram.size(); i++)
+        {
+            if (histogram[i] > 0)
+            {
+                std::cout << " <" << std::to_string(size_t(2) << i) << "us: " << std::to_string(histogram[i]);
+            }
+        }
+        std::cout << "\n";
+    };
+    print_histogram("Decode time", stats.decode_time_histogram);
+    print_histogram("Block latency", stats.block_latency_histogram);
+
+    std::cout << "Datagrams:\n";
+    std::cout << "\t" << std::to_string(stats.datagrams_received) << " received, " << std::to_string(stats.datagrams_lost) << " lost, " <<
+                 std::to_string(stats.datagrams_duplicated) << " duplicated, " << std::to_string(stats.datagrams_out_of_window) << " out of window, " <<
+                 std::to_string(stats.datagrams_rejected) << " rejected, " << std::to_string(stats.datagrams_corrupted) << " corrupted\n";
+
+    for (size_t i = 0; i < stats.receivers.size(); i++)
+    {
+        Fec_Encoder::Stats::Receiver const& receiver = stats.receivers[i];
+        if (receiver.datagrams_received > 0 && (i > 0 || stats.receivers[1].datagrams_received > 0))
+        {
+            std::cout << "Receiver " << std::to_string(i) << ":\t" << std::to_string(receiver.datagrams_received) << " received, " <<
+                         std::to_string(receiver.datagrams_used) << " used, " << std::to_string(receiver.datagrams_exclusive) << " exclusive, " <<
+                         std::to_string(receiver.datagrams_duplicated) << " from other receivers first\n";
+        }
     }
+}
+template <typename Encoder> void print_fec_stats(Encoder const& encoder)
+{
+}
 
+//Feeds packets to tx for a few seconds, passes the encoded datagrams to rx through the simulated loss model
+// and reports what comes out. Works with both Fec_Encoder and Static_Fec_Encoder
+template <typename TX_Encoder, typename RX_Encoder>
+int benchmark_fec(TX_Encoder& tx, RX_Encoder& rx)
+{
     typedef Fec_Encoder::Clock Clock;
 
-    std::string reference = "This is a test sentence. There are many like it, but this one is mine."
-            "This is a test sentence. There are many like it, but this one is mine."
-            "This is a test sentence. There are many like it, but this one is mine."
-            "This is a test sentence. There are many like it, but this one is mine."
-            "This is a test sentence. There are many like it, but this one is mine."
-            "This is a test sentence. There are many like it, but this one is mine."
-            "This is a test sentence. There are many like it, but this one is mine."
-            "This is a test sentence. There are many like it, but this one is mine."
-            "This is a test sentence. There are many like it, but this one is mine."
-            "This is a test sentence. There are many like it, but this one is mine."
-            "This is a test sentence. There are many like it, but this one is mine."
-            "This is a test sentence. There are many like it, but this one is mine."
-            "This is a test sentence. There are many like it, but this one is mine."
-            "This is a test sentence. There are many like it, but this one is mine."
-            "This is a test sentence. There are many like it, but this one is mine."
-            "This is a test sentence. There are many like it, but this one is mine."
-            "This is a test sentence. There are many like it, but this one is mine.";
+    std::string reference = "This is a test sentence. There are many like it, but this one is mine.";
+
+    //Every packet fills exactly one datagram and starts with its sequence number and send time
+    // so the receiver can measure latency and how many packets made it through.
+    struct Packet_Header
+    {
+        uint64_t seq_number;
+        uint64_t send_time_us;
+    };
+    size_t packet_size = tx.get_data_size();
+    if (packet_size < sizeof(Packet_Header))
+    {
+        std::cerr << "The mtu is too small for the benchmark\n";
+        return -1;
+    }
+
+    //the header is gathered in front of the payload by the encoder
+    std::vector<uint8_t> packet(packet_size - sizeof(Packet_Header));
+    for (size_t i = 0; i < packet.size(); i++)
+    {
+        packet[i] = reference[i % reference.size()];
+    }
+
+    auto now_us = []() -> uint64_t
+    {
+        return std::chrono::duration_cast<std::chrono::microseconds>(Clock::now().time_since_epoch()).count();
+    };
 
     size_t total_data_size = 0;
     size_t total_fec_data_size = 0;
+    size_t sent_packets = 0;
 
     size_t encoded_packets = 0;
     size_t encoded_size = 0;
-    size_t decoded_packets = 0;
+    size_t lost_packets = 0;
+    std::atomic<size_t> decoded_packets = { 0 };
     size_t decoded_size = 0;
+    uint64_t total_latency_us = 0;
+    uint64_t max_latency_us = 0;
+
+    //burst loss model: every datagram has a s_fec_benchmark_burst_rate chance of starting a burst
+    // that wipes out the next s_fec_benchmark_burst_length datagrams. Every receiver has its own bursts
+    std::mt19937 rng(0);
+    std::uniform_real_distribution<float> distribution(0.f, 1.f);
+    std::vector<size_t> burst_left(s_fec_benchmark_receivers, 0);
 
-    tx.on_tx_data_encoded = [&rx, &encoded_size, &encoded_packets, &total_fec_data_size](void const* data, size_t size)
+    tx.on_tx_data_encoded = [&](void const* data, size_t size)
     {
         total_fec_data_size += size;
         encoded_size += size;
         encoded_packets++;
-        rx.add_rx_packet(data, size, true);
+
+        bool is_lost = true;
+        for (size_t i = 0; i < burst_left.size(); i++)
+        {
+            if (burst_left[i] == 0 && s_fec_benchmark_burst_rate > 0.f && distribution(rng) < s_fec_benchmark_burst_rate)
+            {
+                burst_left[i] = s_fec_benchmark_burst_length;
+            }
+            if (burst_left[i] > 0)
+            {
+                burst_left[i]--;
+                continue;
+            }
+            //the further receivers get a weaker signal
+            add_fec_rx_packet(rx, data, size, i, -50 - 10 * static_cast<int>(i));
+            is_lost = false;
+        }
+        if (is_lost)
+        {
+            lost_packets++;
+        }
     };
 
-    rx.on_rx_data_decoded = [&reference, &decoded_size, &decoded_packets](void const* data, size_t size)
+    rx.on_rx_data_decoded = [&](void const* data, size_t size)
     {
         decoded_size += size;
+        if (size >= sizeof(Packet_Header))
+        {
+            Packet_Header header;
+            memcpy(&header, data, sizeof(Packet_Header));
+            uint64_t latency_us = now_us() - header.send_time_us;
+            total_latency_us += latency_us;
+            max_latency_us = std::max(max_latency_us, latency_us);
+        }
         decoded_packets++;
     };
 
@@ -296,14 +620,31 @@ int run_fec_benchmark()
     Clock::time_point start_tp = Clock::now();
     while (Clock::now() - start_tp < std::chrono::duration<float>(seconds))
     {
-        tx.add_tx_packet(reference.data(), reference.size(), true);
-        total_data_size += reference.size();
+        Packet_Header header;
+        header.seq_number = sent_packets++;
+        header.send_time_us = now_us();
+
+        iovec iov[2];
+        iov[0].iov_base = &header;
+        iov[0].iov_len = sizeof(Packet_Header);
+        iov[1].iov_base = packet.data();
+        iov[1].iov_len = packet.size();
+        tx.add_tx_packet(iov, 2, true);
+        total_data_size += packet_size;
     }
 
-    while (decoded_size + s_mtu * 2 < total_data_size)
+    //wait for the decoder to go idle. With losses not everything will make it through
+    size_t last_decoded_packets = 0;
+    do
     {
-        std::this_thread::sleep_for(std::chrono::milliseconds(10));
-    }
+        last_decoded_packets = decoded_packets;
+        for (size_t i = 0; i < 50; i++)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            process_fec(tx);
+            process_fec(rx);
+        }
+    } while (last_decoded_packets != decoded_packets);
 
     float total_data_size_mb = static_cast<float>(total_data_size) / (1024.f * 1024.f);
     float total_fec_data_size_mb = static_cast<float>(total_fec_data_size) / (1024.f * 1024.f);
@@ -313,24 +654,24 @@ int run_fec_benchmark()
     std::cout << "Encoded:\n";
     std::cout << "\t" << std::to_string(static_cast<float>(encoded_size)  / (seconds * 1024.f * 1024.f)) << " MBps\n";
     std::cout << "\t" << std::to_string(encoded_packets) << " packets\n";
+    std::cout << "\t" << std::to_string(lost_packets) << " packets lost in transit\n";
     std::cout << "Decoded:\n";
     std::cout << "\t" << std::to_string(static_cast<float>(decoded_size) / (seconds * 1024.f * 1024.f)) << " MBps\n";
     std::cout << "\t" << std::to_string(decoded_packets) << " packets\n";
+    std::cout << "\t" << std::to_string(sent_packets > 0 ? 100.f * decoded_packets / sent_packets : 0.f) << "% recovered\n";
+    if (decoded_packets > 0)
+    {
+        std::cout << "\t" << std::to_string(total_latency_us / decoded_packets / 1000.f) << " ms average latency, " <<
+                     std::to_string(max_latency_us / 1000.f) << " ms max\n";
+    }
+    print_fec_stats(rx);
 
     return 0;
 }
 
 
-int run_fec(Phy& phy)
+int run_fec_benchmark()
 {
-    if (s_verbose)
-    {
-        std::cout << "FEC\n\tK " << std::to_string(s_fec_coding_k) <<
-                     "\n\tN " << std::to_string(s_fec_coding_n) << "\n";
-    }
-
-    typedef Fec_Encoder::Clock Clock;
-
     Fec_Encoder tx;
     Fec_Encoder rx;
 
@@ -338,6 +679,12 @@ int run_fec(Phy& phy)
     tx_descriptor.coding_k = s_fec_coding_k;
     tx_descriptor.coding_n = s_fec_coding_n;
     tx_descriptor.mtu = s_mtu;
+    tx_descriptor.interleaving_depth = s_fec_interleaving_depth;
+    tx_descriptor.fec_spread = s_fec_spread;
+    tx_descriptor.drop_oldest = s_fec_drop_oldest;
+    tx_descriptor.is_checksummed = s_fec_checksum;
+    tx_descriptor.encryption_key = s_encryption_key;
+    tx_descriptor.is_synchronous = s_fec_benchmark_sync;
     if (!tx.init_tx(tx_descriptor))
     {
         return -1;
@@ -347,18 +694,427 @@ int run_fec(Phy& phy)
     rx_descriptor.coding_k = s_fec_coding_k;
     rx_descriptor.coding_n = s_fec_coding_n;
     rx_descriptor.mtu = s_mtu;
+    rx_descriptor.interleaving_depth = s_fec_interleaving_depth;
+    rx_descriptor.max_block_hold = std::chrono::milliseconds(s_fec_max_hold_ms);
+    rx_descriptor.is_unordered = s_fec_unordered;
+    rx_descriptor.encryption_key = s_encryption_key;
+    rx_descriptor.is_synchronous = s_fec_benchmark_sync;
     if (!rx.init_rx(rx_descriptor))
     {
         return -1;
     }
 
-    tx.on_tx_data_encoded = [&phy](void const* data, size_t size)
+    return benchmark_fec(tx, rx);
+}
+
+
+int run_static_fec_benchmark()
+{
+    //the configuration has to be known at compile time
+    static const uint8_t STATIC_CODING_K = 12;
+    static const uint8_t STATIC_CODING_N = 20;
+    typedef Static_Fec_Encoder<STATIC_CODING_K, STATIC_CODING_N, MAX_MTU> Encoder;
+
+    if (s_fec_coding_k != STATIC_CODING_K || s_fec_coding_n != STATIC_CODING_N || s_mtu != MAX_MTU || s_fec_interleaving_depth != 1 || s_fec_spread != 0 ||
+            !s_encryption_key.empty())
+    {
+        std::cerr << "The static FEC benchmark supports only --fec " << std::to_string(STATIC_CODING_K) << " " << std::to_string(STATIC_CODING_N) <<
+                     " --mtu " << std::to_string(MAX_MTU) << " without interleaving, spreading or encryption\n";
+        return -1;
+    }
+
+    //too big for the stack
+    std::unique_ptr<Encoder> tx(new Encoder);
+    std::unique_ptr<Encoder> rx(new Encoder);
+    if (!tx->init_tx(0, s_fec_checksum) || !rx->init_rx(0))
+    {
+        return -1;
+    }
+
+    return benchmark_fec(*tx, *rx);
+}
+
+
+int run_crypto_benchmark()
+{
+    typedef Fec_Encoder::Clock Clock;
+
+    //mtu sized datagrams, encrypted in place like the Fec_Encoder does
+    std::vector<uint8_t> key(CHACHA20_POLY1305_KEY_SIZE, 0x42);
+    std::vector<uint8_t> nonce(CHACHA20_POLY1305_NONCE_SIZE, 0);
+    std::vector<uint8_t> data(s_mtu, 0x17);
+    uint8_t tag[CHACHA20_POLY1305_TAG_SIZE];
+
+    float seconds = 2.f;
+    size_t encrypted_size = 0;
+    Clock::time_point start_tp = Clock::now();
+    while (Clock::now() - start_tp < std::chrono::duration<float>(seconds))
+    {
+        nonce[0]++;
+        chacha20_poly1305_encrypt(key.data(), nonce.data(), nullptr, 0, data.data(), data.data(), data.size(), tag);
+        encrypted_size += data.size();
+    }
+    float encrypt_ns = std::chrono::duration<float, std::nano>(Clock::now() - start_tp).count();
+
+    size_t decrypted_size = 0;
+    start_tp = Clock::now();
+    while (Clock::now() - start_tp < std::chrono::duration<float>(seconds))
+    {
+        chacha20_poly1305_encrypt(key.data(), nonce.data(), nullptr, 0, data.data(), data.data(), data.size(), tag);
+        chacha20_poly1305_decrypt(key.data(), nonce.data(), nullptr, 0, data.data(), data.data(), data.size(), tag);
+        decrypted_size += data.size();
+    }
+    float decrypt_ns = std::chrono::duration<float, std::nano>(Clock::now() - start_tp).count();
+
+    std::cout << "Encrypt:\t" << std::to_string(encrypted_size / (encrypt_ns / 1e9f) / (1024.f * 1024.f)) << " MBps, " <<
+                 std::to_string(encrypt_ns / encrypted_size) << " ns/byte\n";
+    std::cout << "Encrypt + decrypt:\t" << std::to_string(decrypted_size / (decrypt_ns / 1e9f) / (1024.f * 1024.f)) << " MBps, " <<
+                 std::to_string(decrypt_ns / decrypted_size) << " ns/byte\n";
+    return 0;
+}
+
+
+//Host side copy of the firmware send queue (Queue<S2W_BUFFER_SIZE> in firmware/structures.h), same offsets and
+// the same wrap rules, with the packets draining at the PHY rate.
+class Emulated_Firmware_Queue
+{
+public:
+    bool push(size_t size, double arrival_us)
+    {
+        size_t real_size = size + Phy::FIRMWARE_PACKET_OVERHEAD - sizeof(uint32_t);
+        size_t start = m_write_start;
+        size_t end = start + sizeof(uint32_t) + real_size;
+        if (end <= N)
+        {
+            if (start < m_read_start && end >= m_read_start)
+            {
+                return false;
+            }
+        }
+        else
+        {
+            end = real_size;
+            if (m_read_start > start || end >= m_read_start)
+            {
+                return false;
+            }
+        }
+        m_write_start = end;
+        m_packets.push_back({ size, real_size, arrival_us });
+        return true;
+    }
+
+    //sends everything that went on air before now_us
+    void drain(double now_us, Phy::Rate rate)
+    {
+        while (!m_packets.empty())
+        {
+            Packet const& packet = m_packets.front();
+            double start_us = std::max(m_air_free_us, packet.arrival_us);
+            double end_us = start_us + std::chrono::duration<double, std::micro>(Pacer::compute_airtime(rate, packet.size)).count();
+            if (end_us > now_us)
+            {
+                break;
+            }
+            size_t end = m_read_start + sizeof(uint32_t) + packet.real_size;
+            m_read_start = end <= N ? end : packet.real_size;
+            m_air_free_us = end_us;
+            m_sent_size += packet.size;
+            m_packets.pop_front();
+        }
+    }
+
+    //what the firmware reports
+    size_t get_free_size() const
+    {
+        size_t size = 0;
+        if (m_write_start > m_read_start)
+        {
+            size = m_write_start - m_read_start;
+        }
+        else if (m_write_start < m_read_start)
+        {
+            size = (N - m_read_start) + m_write_start;
+        }
+        return N - size;
+    }
+
+    size_t get_sent_size() const { return m_sent_size; }
+
+private:
+    static const size_t N = Phy::FIRMWARE_QUEUE_SIZE;
+
+    struct Packet
     {
-//        std::cout << "sending fec data " << std::to_string(size) << "\n";
-        phy.send_data(data, size);
+        size_t size;
+        size_t real_size;
+        double arrival_us;
     };
+    std::deque<Packet> m_packets;
+    size_t m_write_start = 0;
+    size_t m_read_start = 0;
+    double m_air_free_us = 0;
+    size_t m_sent_size = 0;
+};
+
+
+//Sends mtu sized packets as fast as the SPI allows to the emulated firmware queue for a few (simulated) seconds,
+// once blindly and once waiting for TX credits the way Phy::wait_for_tx_credits does, and reports what the firmware drops
+int run_tx_credits_benchmark()
+{
+    //the same timings as the real thing: SPI transfers of 64 byte chunks with a delay after each,
+    // the RX poll every 500us reports the credits for free and waiting polls them every 100us
+    const double spi_us_per_byte = 8e6 / s_spi_speed;
+    const double command_us = 5 * spi_us_per_byte + s_spi_delay;
+    const double rx_poll_period_us = 500;
+    const double credits_poll_period_us = 100;
+    const double duration_us = 5e6;
+
+    size_t chunks = (s_mtu + 2 + 63) / 64;
+    double send_us = command_us + chunks * (66 * spi_us_per_byte + s_spi_delay);
+
+    for (bool use_credits: { false, true })
+    {
+        Emulated_Firmware_Queue queue;
+        size_t sent_packets = 0;
+        size_t dropped_packets = 0;
+        double waiting_us = 0;
+
+        size_t credits = Phy::compute_tx_credits(queue.get_free_size());
+        size_t cost = Phy::compute_tx_cost(s_mtu);
+        double now_us = 0;
+        double next_rx_poll_us = rx_poll_period_us;
+        while (now_us < duration_us)
+        {
+            if (use_credits)
+            {
+                while (credits < cost)
+                {
+                    now_us += credits_poll_period_us + 2 * command_us;
+                    waiting_us += credits_poll_period_us + 2 * command_us;
+                    queue.drain(now_us, s_phy_rate);
+                    credits = Phy::compute_tx_credits(queue.get_free_size());
+                }
+            }
+
+            now_us += send_us;
+            queue.drain(now_us, s_phy_rate);
+            if (!queue.push(s_mtu, now_us))
+            {
+                dropped_packets++;
+            }
+            sent_packets++;
+            credits = credits > cost ? credits - cost : 0;
+
+            if (now_us >= next_rx_poll_us)
+            {
+                now_us += 2 * command_us;
+                next_rx_poll_us = now_us + rx_poll_period_us;
+                queue.drain(now_us, s_phy_rate);
+                credits = Phy::compute_tx_credits(queue.get_free_size());
+            }
+        }
+
+        float seconds = static_cast<float>(now_us / 1e6);
+        std::cout << (use_credits ? "With TX credits:\n" : "Without TX credits:\n");
+        std::cout << "\t" << std::to_string(sent_packets) << " packets sent over SPI, " << std::to_string(dropped_packets) << " dropped by the firmware (" <<
+                     std::to_string(sent_packets > 0 ? 100.f * dropped_packets / sent_packets : 0.f) << "%)\n";
+        std::cout << "\t" << std::to_string(queue.get_sent_size() / (seconds * 1024.f * 1024.f)) << " MBps on air\n";
+        std::cout << "\t" << std::to_string(100.f * static_cast<float>(waiting_us / now_us)) << "% of the time waiting for credits\n";
+    }
+
+    return 0;
+}
+
+
+//Writes all the buffers with as few writev calls as possible. iov is consumed.
+//Returns false on a write error (errno tells which), the rest of the data is not written
+bool write_all(int fd, std::vector<iovec>& iov)
+{
+    iovec* crt = iov.data();
+    size_t count = iov.size();
+    while (count > 0)
+    {
+        ssize_t res = writev(fd, crt, std::min<size_t>(count, IOV_MAX));
+        if (res < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                //a terminal's stdout shares the non blocking flag set on stdin, wait for room like a blocking write would
+                pollfd pfd = { fd, POLLOUT, 0 };
+                poll(&pfd, 1, -1);
+                continue;
+            }
+            iov.clear();
+            return false;
+        }
+
+        //partial write, skip what's done and continue from the middle of the buffer it stopped in
+        size_t written = res;
+        while (count > 0 && written >= crt->iov_len)
+        {
+            written -= crt->iov_len;
+            crt++;
+            count--;
+        }
+        if (count > 0)
+        {
+            crt->iov_base = reinterpret_cast<uint8_t*>(crt->iov_base) + written;
+            crt->iov_len -= written;
+        }
+    }
+    iov.clear();
+    return true;
+}
+
+
+//Returns false if the packet has to be dropped because the firmware queue had no room for it in time
+bool wait_for_tx_room(Phy& phy, Pacer& pacer, size_t size)
+{
+    if (s_tx_credits)
+    {
+        Phy::Clock::duration timeout = s_tx_credits_max_wait_ms > 0 ? Phy::Clock::duration(std::chrono::milliseconds(s_tx_credits_max_wait_ms)) :
+                                                                    Phy::Clock::duration::max();
+        if (!phy.wait_for_tx_credits(size, timeout))
+        {
+            return false;
+        }
+    }
+    if (s_tx_pacing)
+    {
+        pacer.wait(size);
+    }
+    return true;
+}
+
+
+//rx_phys are the extra diversity receivers, phy is receiver 0
+int run_fec(Phy& phy, std::vector<std::unique_ptr<Phy>>& rx_phys, Pacer& pacer)
+{
+    if (s_verbose)
+    {
+        std::cout << "FEC\n\tK " << std::to_string(s_fec_coding_k) <<
+                     "\n\tN " << std::to_string(s_fec_coding_n) <<
+                     "\n\tinterleaving depth " << std::to_string(s_fec_interleaving_depth) << "\n";
+    }
+
+    typedef Fec_Encoder::Clock Clock;
+
+    //The encoders push their output in rings and the output thread below does the IO, so the coding
+    // overlaps with the SPI transfers and the stdout writes. Declared first to outlive the decoder
+    Fec_Encoder::Output_Ring rx_ring;
+
+    //Stream 0 is the data, stream 1 the optional control stream. The Mux sends the control datagrams first
+    const uint8_t DATA_STREAM_ID = 0;
+    const uint8_t CONTROL_STREAM_ID = 1;
+    Mux mux;
+    Mux::Descriptor mux_descriptor;
+
+    Mux::TX_Stream_Descriptor tx_stream;
+    Fec_Encoder::TX_Descriptor& tx_descriptor = tx_stream.fec;
+    tx_descriptor.coding_k = s_fec_coding_k;
+    tx_descriptor.coding_n = s_fec_coding_n;
+    tx_descriptor.mtu = s_mtu;
+    tx_descriptor.interleaving_depth = s_fec_interleaving_depth;
+    tx_descriptor.fec_spread = s_fec_spread;
+    tx_descriptor.drop_oldest = s_fec_drop_oldest;
+    tx_descriptor.is_checksummed = s_fec_checksum;
+    tx_descriptor.encryption_key = s_encryption_key;
+    tx_descriptor.stream_id = DATA_STREAM_ID;
+    mux_descriptor.tx_streams.push_back(tx_stream);
+
+    Fec_Encoder::RX_Descriptor rx_descriptor;
+    rx_descriptor.coding_k = s_fec_coding_k;
+    rx_descriptor.coding_n = s_fec_coding_n;
+    rx_descriptor.mtu = s_mtu;
+    rx_descriptor.interleaving_depth = s_fec_interleaving_depth;
+    rx_descriptor.max_block_hold = std::chrono::milliseconds(s_fec_max_hold_ms);
+    rx_descriptor.is_unordered = s_fec_unordered;
+    rx_descriptor.encryption_key = s_encryption_key;
+    rx_descriptor.stream_id = DATA_STREAM_ID;
+    rx_descriptor.output_ring = &rx_ring;
+    //first, the RX buffers come from its decoder
+    mux_descriptor.rx_streams.push_back(rx_descriptor);
+
+    //Short messages, each sent right away in its own datagram. A small mtu and an N of 3 K keep them cheap and
+    // likely to make it through
+    int control_in_fd = -1;
+    int control_out_fd = -1;
+    if (!s_control_in.empty())
+    {
+        control_in_fd = open(s_control_in.c_str(), O_RDONLY | O_NONBLOCK);
+        control_out_fd = open(s_control_out.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (control_in_fd < 0 || control_out_fd < 0)
+        {
+            std::cerr << "Cannot open the control stream files: " << strerror(errno) << "\n";
+            return -1;
+        }
+
+        Mux::TX_Stream_Descriptor control_tx_stream;
+        control_tx_stream.priority = 1;
+        control_tx_stream.fec.coding_k = 1;
+        control_tx_stream.fec.coding_n = 3;
+        control_tx_stream.fec.mtu = 64;
+        control_tx_stream.fec.is_checksummed = s_fec_checksum;
+        control_tx_stream.fec.encryption_key = s_encryption_key;
+        control_tx_stream.fec.stream_id = CONTROL_STREAM_ID;
+        mux_descriptor.tx_streams.push_back(control_tx_stream);
+
+        Fec_Encoder::RX_Descriptor control_rx_descriptor;
+        control_rx_descriptor.coding_k = 1;
+        control_rx_descriptor.coding_n = 3;
+        control_rx_descriptor.mtu = 64;
+        control_rx_descriptor.encryption_key = s_encryption_key;
+        control_rx_descriptor.stream_id = CONTROL_STREAM_ID;
+        mux_descriptor.rx_streams.push_back(control_rx_descriptor);
+
+        //from the control decoder's thread, the only one writing there. The datagrams are padded with zeros
+        mux.on_rx_data_decoded = [control_out_fd](uint8_t, void const* data, size_t size)
+        {
+            uint8_t const* ptr = reinterpret_cast<uint8_t const*>(data);
+            std::vector<iovec> iov;
+            for (size_t i = 0; i < size;)
+            {
+                size_t start = i;
+                while (i < size && ptr[i] != 0)
+                {
+                    i++;
+                }
+                if (i > start)
+                {
+                    iov.push_back({ const_cast<uint8_t*>(ptr + start), i - start });
+                }
+                for (; i < size && ptr[i] == 0; i++) {}
+            }
+            if (!iov.empty() && !write_all(control_out_fd, iov))
+            {
+                std::cerr << "Cannot write the control data: " << strerror(errno) << "\n";
+            }
+        };
+    }
+
+    if (s_verbose)
+    {
+        //set before init, it's called from the RX threads
+        mux.on_rx_data_lost = [](uint8_t stream_id, uint64_t stream_offset, size_t size)
+        {
+            std::cerr << "Lost " << std::to_string(size) << " bytes at " << std::to_string(stream_offset) <<
+                         " on stream " << std::to_string(stream_id) << "\n";
+        };
+    }
+    if (!mux.init(mux_descriptor))
+    {
+        return -1;
+    }
+    Fec_Encoder& tx = *mux.get_tx_stream(DATA_STREAM_ID);
+    Fec_Encoder& rx = *mux.get_rx_stream(DATA_STREAM_ID);
+    Fec_Encoder* control_tx = mux.get_tx_stream(CONTROL_STREAM_ID);
 
-    rx.on_rx_data_decoded = [](void const* data, size_t size)
+    auto write_output = [](void const* data, size_t size)
     {
         std::cout.write(reinterpret_cast<const char*>(data), size);
         if (s_flush)
@@ -367,7 +1123,88 @@ int run_fec(Phy& phy)
         }
     };
 
-    std::array<uint8_t, Phy::MAX_PAYLOAD_SIZE> rx_data;
+    //optional compression in front of the encoder and after the decoder
+    Compressor compressor;
+    Compressor decompressor;
+    bool is_frame_compressed = false;
+    if (s_compress)
+    {
+        Compressor::Descriptor compressor_descriptor;
+        if (!compressor.init_tx(compressor_descriptor) || !decompressor.init_rx(compressor_descriptor))
+        {
+            return -1;
+        }
+        compressor.on_tx_data_compressed = [&tx, &is_frame_compressed](void const* data, size_t size)
+        {
+            is_frame_compressed = true;
+            tx.add_tx_packet(data, size, true);
+        };
+        decompressor.on_rx_data_decompressed = write_output;
+    }
+
+    //The rings are drained on their own thread. Draining them from this one would deadlock when the encoders wait
+    // for room in the rings while this thread waits for room in the encoder input queues
+    //the decoded data bypasses std::cout from now on, what's buffered goes first
+    std::cout.flush();
+
+    std::atomic_bool output_exit = { false };
+    std::atomic_bool output_error = { false };
+    std::thread output_thread([&]()
+    {
+        std::vector<Fec_Encoder::Data_ptr> rx_batch;
+        std::vector<iovec> rx_batch_iov;
+        rx_batch.reserve(IOV_MAX);
+        rx_batch_iov.reserve(IOV_MAX);
+
+        while (!output_exit)
+        {
+            bool is_idle = true;
+            Fec_Encoder::Data_ptr data;
+            //one at a time in priority order, a control datagram queued meanwhile goes ahead of the rest of the data
+            while (mux.pop_tx_datagram(data))
+            {
+//                std::cout << "sending fec data " << std::to_string(data->size()) << "\n";
+                //waiting here fills the ring, then the encoder queue and finally blocks add_tx_packet
+                if (wait_for_tx_room(phy, pacer, data->size()))
+                {
+                    phy.send_data(data->data(), data->size());
+                }
+                is_idle = false;
+            }
+            //everything decoded since the last time goes out in a single writev instead of a write per datagram
+            while (rx_batch.size() < IOV_MAX && rx_ring.try_pop(data))
+            {
+                if (s_compress)
+                {
+                    decompressor.add_rx_packet(data->data(), data->size());
+                }
+                else if (!data->empty())
+                {
+                    rx_batch_iov.push_back({ const_cast<uint8_t*>(data->data()), data->size() });
+                    rx_batch.push_back(data);
+                }
+                is_idle = false;
+            }
+            if (!rx_batch.empty())
+            {
+                if (!output_error && !write_all(STDOUT_FILENO, rx_batch_iov))
+                {
+                    //the main loop stops on this. Until then the rings are still drained so nothing blocks on them
+                    std::cerr << "Cannot write the decoded data: " << strerror(errno) << "\n";
+                    output_error = true;
+                }
+                rx_batch_iov.clear();
+                rx_batch.clear();
+            }
+            if (is_idle)
+            {
+                std::this_thread::sleep_for(std::chrono::microseconds(100));
+            }
+        }
+    });
+
+    //received straight into the decoder's datagrams, kept until a packet arrives
+    Fec_Encoder::RX_Buffer rx_buffer;
     size_t rx_data_size = 0;
     int rx_rssi = 0;
 
@@ -380,16 +1217,53 @@ int run_fec(Phy& phy)
     int flags = fcntl(STDIN_FILENO, F_GETFL, 0);
     fcntl(STDIN_FILENO, F_SETFL, flags | O_NONBLOCK);
 
+    std::vector<Phy*> receivers = { &phy };
+    for (std::unique_ptr<Phy>& p: rx_phys)
+    {
+        receivers.push_back(p.get());
+    }
+
     Clock::time_point last_receive_tp = Clock::now();
-    while (true)
+    Clock::time_point last_stats_tp = Clock::now();
+    while (!output_error)
     {
         if (Clock::now() - last_receive_tp >= std::chrono::microseconds(500))
         {
             last_receive_tp = Clock::now();
-            if (phy.receive_data(rx_data.data(), rx_data_size, rx_rssi))
+
+            //all the receivers from this thread, the decoder takes its packets from a single thread
+            for (size_t i = 0; i < receivers.size(); i++)
+            {
+                if ((rx_buffer.datagram || mux.acquire_rx_buffer(rx_buffer)) &&
+                        receivers[i]->receive_data(rx_buffer.iov.data(), rx_buffer.iov.size(), rx_data_size, rx_rssi))
+                {
+                    //std::cout << "received packet " << std::to_string(rx_data_size) << "\n";
+                    rx_buffer.receiver = i;
+                    rx_buffer.rssi = rx_rssi;
+                    mux.add_rx_buffer(rx_buffer, rx_data_size, true);
+                }
+            }
+        }
+
+        if (s_verbose && receivers.size() > 1 && Clock::now() - last_stats_tp >= std::chrono::seconds(10))
+        {
+            last_stats_tp = Clock::now();
+            Fec_Encoder::Stats stats = rx.get_stats();
+            for (size_t i = 0; i < receivers.size(); i++)
             {
-                //std::cout << "received packet " << std::to_string(rx_data_size) << "\n";
-                rx.add_rx_packet(rx_data.data(), rx_data_size, true);
+                Fec_Encoder::Stats::Receiver const& receiver = stats.receivers[i];
+                std::cerr << "Receiver " << std::to_string(i) << ": " << std::to_string(receiver.datagrams_received) << " received, " <<
+                             std::to_string(receiver.datagrams_used) << " used, " << std::to_string(receiver.datagrams_exclusive) << " exclusive\n";
+            }
+        }
+
+        if (control_tx)
+        {
+            int res = read(control_in_fd, tx_data.data(), tx_data.size());
+            if (res > 0)
+            {
+                control_tx->add_tx_packet(tx_data.data(), static_cast<size_t>(res), true);
+                control_tx->flush_tx_packet(true);
             }
         }
 
@@ -397,15 +1271,43 @@ int run_fec(Phy& phy)
             int res = read(STDIN_FILENO, tx_data.data(), tx_data.size());
             if (res > 0)
             {
-                tx.add_tx_packet(tx_data.data(), static_cast<size_t>(res), true);
+                if (s_compress)
+                {
+                    compressor.add_tx_packet(tx_data.data(), static_cast<size_t>(res));
+                }
+                else
+                {
+                    tx.add_tx_packet(tx_data.data(), static_cast<size_t>(res), true);
+                }
+            }
+            else if (s_compress)
+            {
+                //don't keep data waiting for more than the compressor's max latency, in the compressor or in the
+                // encoder's partial datagram. Only when a frame actually went out because of it, otherwise every idle
+                // poll would send a padded datagram. The decompressor skips the padding
+                is_frame_compressed = false;
+                compressor.process_tx();
+                if (is_frame_compressed)
+                {
+                    tx.flush_tx_packet(true);
+                }
             }
         }
     }
 
-    return 0;
+    output_exit = true;
+    output_thread.join();
+
+    if (control_in_fd >= 0)
+    {
+        close(control_in_fd);
+        close(control_out_fd);
+    }
+
+    return output_error ? -1 : 0;
 }
 
-int run_no_fec(Phy& phy)
+int run_no_fec(Phy& phy, Pacer& pacer)
 {
     typedef Fec_Encoder::Clock Clock;
 
@@ -443,7 +1345,10 @@ int run_no_fec(Phy& phy)
             int res = read(STDIN_FILENO, tx_data.data(), s_mtu);
             if (res > 0)
             {
-                phy.send_data(tx_data.data(), res);
+                if (wait_for_tx_room(phy, pacer, res))
+                {
+                    phy.send_data(tx_data.data(), res);
+                }
             }
         }
     }
@@ -470,6 +1375,20 @@ int main(int argc, const char* argv[])
         s_fec_coding_n = 20;
     }
 
+    //the benchmarks don't touch the hardware
+    if (s_crypto_benchmark)
+    {
+        return run_crypto_benchmark();
+    }
+    if (s_fec_benchmark)
+    {
+        return s_fec_benchmark_static ? run_static_fec_benchmark() : run_fec_benchmark();
+    }
+    if (s_tx_credits_benchmark)
+    {
+        return run_tx_credits_benchmark();
+    }
+
     if (gpioCfgClock(5, PI_CLOCK_PCM, 0) < 0 || gpioCfgPermissions(static_cast<uint64_t>(-1)))
     {
         std::cerr << "Cannot configure pigpio\n";
@@ -481,10 +1400,6 @@ int main(int argc, const char* argv[])
         return -1;
     }
 
-    if (s_fec_benchmark)
-    {
-        return run_fec_benchmark();
-    }
     if (s_phy_benchmark)
     {
         //return run_phy_benchmark();
@@ -542,7 +1457,49 @@ int main(int argc, const char* argv[])
                   << "\n";
     }
 
-    result = s_use_fec ? run_fec(phy) : run_no_fec(phy);
+    if (s_tx_credits && !phy.update_tx_credits())
+    {
+        std::cerr << "The firmware doesn't report TX credits, sending without them\n";
+    }
+
+    Pacer pacer;
+    Pacer::Descriptor pacer_descriptor;
+    pacer_descriptor.rate = actual_rate >= 0 ? static_cast<Phy::Rate>(actual_rate) : s_phy_rate;
+    if (!pacer.init(pacer_descriptor))
+    {
+        return -1;
+    }
+
+    //the diversity receivers only listen, with the same settings as the main one
+    if (!s_control_in.empty() && !s_use_fec)
+    {
+        std::cerr << "The control stream needs --fec\n";
+        return -1;
+    }
+
+    std::vector<std::unique_ptr<Phy>> rx_phys;
+    for (std::string const& dev: s_rx_spi_devs)
+    {
+        if (!s_use_fec)
+        {
+            std::cerr << "Several receivers need --fec to merge their packets\n";
+            return -1;
+        }
+        if (s_verbose)
+        {
+            std::cout << "RX SPI\n\tdev " << dev << "\n";
+        }
+        std::unique_ptr<Phy> rx_phy(new Phy);
+        if (rx_phy->init_dev(dev.c_str(), s_spi_speed, s_spi_delay) != Phy::Init_Result::OK)
+        {
+            return -1;
+        }
+        rx_phy->set_rate(s_phy_rate);
+        rx_phy->set_channel(s_phy_channel);
+        rx_phys.push_back(std::move(rx_phy));
+    }
+
+    result = s_use_fec ? run_fec(phy, rx_phys, pacer) : run_no_fec(phy, pacer);
 
     gpioTerminate();
 
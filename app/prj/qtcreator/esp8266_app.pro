@@ -58,17 +58,30 @@ DESTDIR = ../../bin
 HEADERS += \
     ../../../lib/Phy.h \
     ../../../lib/utils/fec.h \
+    ../../../lib/utils/chacha20_poly1305.h \
+    ../../../lib/utils/crc32c.h \
     ../../../lib/utils/pigpio.h \
     ../../../lib/utils/command.h \
     ../../../lib/Pool.h \
     ../../../lib/Fec_Encoder.h \
-    ../../../lib/Queue.h
+    ../../../lib/Static_Fec_Encoder.h \
+    ../../../lib/Mux.h \
+    ../../../lib/Pacer.h \
+    ../../../lib/Compressor.h \
+    ../../../lib/Queue.h \
+    ../../../lib/Spsc_Ring.h \
+    ../../../lib/Spsc_Queue.h
 
 SOURCES += \
     ../../main.cpp \
     ../../../lib/Phy.cpp \
     ../../../lib/utils/fec.cpp \
+    ../../../lib/utils/chacha20_poly1305.cpp \
+    ../../../lib/utils/crc32c.cpp \
     ../../../lib/utils/pigpio.c \
     ../../../lib/utils/command.c \
-    ../../../lib/Fec_Encoder.cpp
+    ../../../lib/Fec_Encoder.cpp \
+    ../../../lib/Mux.cpp \
+    ../../../lib/Pacer.cpp \
+    ../../../lib/Compressor.cpp
 
@@ -337,10 +337,18 @@ enum SPI_Command : uint16_t
     SPI_CMD_SET_POWER = 7,
     SPI_CMD_GET_POWER = 8,
     SPI_CMD_GET_STATS = 9,
+    SPI_CMD_GET_TX_CREDITS = 10,
 };
 
 uint32_t s_spi_temp_buffer[16];
 
+//the free space in the send queue, so the host knows how much it can send before packets get dropped
+uint32_t get_tx_credits_status()
+{
+  uint32_t free_size = s_s2w_queue.capacity() - s_s2w_queue.size();
+  return (uint32_t(SPI_Command::SPI_CMD_GET_TX_CREDITS) << 24) | (free_size & 0xFFFF);
+}
+
 void spi_on_data_received()
 {
   lock_guard lg;
@@ -495,7 +503,7 @@ void spi_on_status_received(uint32_t status)
     }
     else
     {
-      spi_slave_set_status(0);
+      spi_slave_set_status(get_tx_credits_status()); //nothing to receive, report the credits instead
     }
     return;
   }
@@ -580,6 +588,10 @@ void spi_on_status_received(uint32_t status)
     memcpy(data, &s_stats, sizeof(Stats));
     spi_slave_set_data(data);
   }
+  else if (command == SPI_Command::SPI_CMD_GET_TX_CREDITS)
+  {
+    spi_slave_set_status(get_tx_credits_status());
+  }
   else
   {
       LOG("Unknown command: %d\n", command);
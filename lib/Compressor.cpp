@@ -0,0 +1,308 @@
+#include "Compressor.h"
+#include <algorithm>
+#include <cstring>
+#include <zlib.h>
+
+const size_t Compressor::MAX_FRAME_SIZE;
+
+static const uint16_t FRAME_MAGIC = 0x5A43;
+
+#pragma pack(push, 1)
+
+struct Compressor::Frame_Header
+{
+    uint16_t magic = FRAME_MAGIC;
+    uint16_t compressed_size = 0;
+    uint16_t uncompressed_size = 0;
+};
+
+#pragma pack(pop)
+
+struct Compressor::Impl
+{
+    z_stream stream;
+    bool is_initialized = false;
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+Compressor::Compressor()
+{
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+Compressor::~Compressor()
+{
+    if (m_impl && m_impl->is_initialized)
+    {
+        if (m_is_tx)
+        {
+            deflateEnd(&m_impl->stream);
+        }
+        else
+        {
+            inflateEnd(&m_impl->stream);
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+bool Compressor::init_tx(Descriptor const& descriptor)
+{
+    if (m_impl || descriptor.max_frame_size == 0 || descriptor.max_frame_size > MAX_FRAME_SIZE)
+    {
+        return false;
+    }
+
+    m_is_tx = true;
+    m_descriptor = descriptor;
+    m_impl.reset(new Impl);
+    memset(&m_impl->stream, 0, sizeof(z_stream));
+    if (deflateInit(&m_impl->stream, descriptor.level) != Z_OK)
+    {
+        //QLOGE("Cannot initialize zlib: {}", m_impl->stream.msg);
+        return false;
+    }
+    m_impl->is_initialized = true;
+
+    m_input.reserve(descriptor.max_frame_size);
+    m_output.resize(sizeof(Frame_Header) + deflateBound(&m_impl->stream, descriptor.max_frame_size));
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+bool Compressor::init_rx(Descriptor const& descriptor)
+{
+    if (m_impl || descriptor.max_frame_size == 0 || descriptor.max_frame_size > MAX_FRAME_SIZE)
+    {
+        return false;
+    }
+
+    m_is_tx = false;
+    m_descriptor = descriptor;
+    m_impl.reset(new Impl);
+    memset(&m_impl->stream, 0, sizeof(z_stream));
+    if (inflateInit(&m_impl->stream) != Z_OK)
+    {
+        //QLOGE("Cannot initialize zlib: {}", m_impl->stream.msg);
+        return false;
+    }
+    m_impl->is_initialized = true;
+
+    m_output.resize(descriptor.max_frame_size);
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+bool Compressor::add_tx_packet(void const* _data, size_t size)
+{
+    if (!m_impl || !m_is_tx)
+    {
+        return false;
+    }
+
+    uint8_t const* data = reinterpret_cast<uint8_t const*>(_data);
+    while (size > 0)
+    {
+        if (m_input.empty())
+        {
+            m_frame_start_tp = Clock::now();
+        }
+
+        size_t s = std::min(size, m_descriptor.max_frame_size - m_input.size());
+        m_input.insert(m_input.end(), data, data + s);
+        data += s;
+        size -= s;
+
+        if (m_input.size() >= m_descriptor.max_frame_size && !compress_frame())
+        {
+            return false;
+        }
+    }
+
+    return process_tx();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+bool Compressor::flush_tx()
+{
+    if (!m_impl || !m_is_tx)
+    {
+        return false;
+    }
+    return m_input.empty() || compress_frame();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+bool Compressor::process_tx()
+{
+    if (!m_impl || !m_is_tx)
+    {
+        return false;
+    }
+    if (!m_input.empty() && Clock::now() - m_frame_start_tp >= m_descriptor.max_latency)
+    {
+        return compress_frame();
+    }
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+bool Compressor::compress_frame()
+{
+    z_stream& stream = m_impl->stream;
+    if (deflateReset(&stream) != Z_OK)
+    {
+        return false;
+    }
+
+    stream.next_in = m_input.data();
+    stream.avail_in = m_input.size();
+    stream.next_out = m_output.data() + sizeof(Frame_Header);
+    stream.avail_out = m_output.size() - sizeof(Frame_Header);
+    if (deflate(&stream, Z_FINISH) != Z_STREAM_END)
+    {
+        //QLOGE("Cannot compress: {}", stream.msg);
+        m_input.clear();
+        return false;
+    }
+
+    //Incompressible data grows a bit but it's still sent deflated - the zlib checksum is what
+    // lets the RX tell a complete frame from one cut by a lost datagram
+    Frame_Header header;
+    header.uncompressed_size = m_input.size();
+    header.compressed_size = stream.total_out;
+    memcpy(m_output.data(), &header, sizeof(Frame_Header));
+
+    if (on_tx_data_compressed)
+    {
+        on_tx_data_compressed(m_output.data(), sizeof(Frame_Header) + header.compressed_size);
+    }
+
+    m_frames++;
+    m_input.clear();
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+bool Compressor::add_rx_packet(void const* _data, size_t size)
+{
+    if (!m_impl || m_is_tx)
+    {
+        return false;
+    }
+
+    uint8_t const* data = reinterpret_cast<uint8_t const*>(_data);
+    m_input.insert(m_input.end(), data, data + size);
+    decompress_frames();
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+bool Compressor::is_frame_header_valid(Frame_Header const& header) const
+{
+    //a frame is never bigger than compressBound(max_frame_size) so a false positive header can't make
+    // the decompressor wait for more than that
+    return header.magic == FRAME_MAGIC &&
+            header.uncompressed_size > 0 && header.uncompressed_size <= m_descriptor.max_frame_size &&
+            header.compressed_size > 0 && header.compressed_size <= compressBound(header.uncompressed_size);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+bool Compressor::inflate_frame(size_t offset, Frame_Header const& header)
+{
+    z_stream& stream = m_impl->stream;
+    if (inflateReset(&stream) != Z_OK)
+    {
+        return false;
+    }
+
+    stream.next_in = m_input.data() + offset + sizeof(Frame_Header);
+    stream.avail_in = header.compressed_size;
+    stream.next_out = m_output.data();
+    stream.avail_out = header.uncompressed_size;
+
+    //the zlib checksum catches frames that were cut by a lost datagram
+    return inflate(&stream, Z_FINISH) == Z_STREAM_END && stream.total_out == header.uncompressed_size;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+size_t Compressor::find_complete_frame(size_t offset)
+{
+    for (; m_input.size() - offset >= sizeof(Frame_Header); offset++)
+    {
+        Frame_Header header;
+        memcpy(&header, m_input.data() + offset, sizeof(Frame_Header));
+        if (is_frame_header_valid(header) &&
+                m_input.size() - offset >= sizeof(Frame_Header) + header.compressed_size &&
+                inflate_frame(offset, header))
+        {
+            return offset;
+        }
+    }
+    return m_input.size();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+void Compressor::decompress_frames()
+{
+    size_t offset = 0;
+    while (m_input.size() - offset >= sizeof(Frame_Header))
+    {
+        Frame_Header header;
+        memcpy(&header, m_input.data() + offset, sizeof(Frame_Header));
+        if (!is_frame_header_valid(header))
+        {
+            //lost sync, look for the next frame one byte at a time
+            offset++;
+            continue;
+        }
+
+        if (m_input.size() - offset < sizeof(Frame_Header) + header.compressed_size)
+        {
+            //Wait for the rest of the frame. Unless it's a false positive - the magic in the data of a frame cut
+            // by a lost datagram - and a complete frame already follows, it would hold that one back until
+            // compressed_size more bytes came in
+            size_t next = find_complete_frame(offset + 1);
+            if (next >= m_input.size())
+            {
+                break;
+            }
+            //QLOGW("Broken frame");
+            m_broken_frames++;
+            offset = next;
+            continue;
+        }
+
+        if (!inflate_frame(offset, header))
+        {
+            //QLOGW("Broken frame");
+            m_broken_frames++;
+            offset++;
+            continue;
+        }
+
+        if (on_rx_data_decompressed)
+        {
+            on_rx_data_decompressed(m_output.data(), header.uncompressed_size);
+        }
+        m_frames++;
+        offset += sizeof(Frame_Header) + header.compressed_size;
+    }
+
+    m_input.erase(m_input.begin(), m_input.begin() + offset);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <vector>
+#include <chrono>
+#include <functional>
+#include <memory>
+
+//Optional zlib compression stage in front of a Fec_Encoder (TX) and after it (RX).
+//TX: the data is buffered and compressed in frames of up to max_frame_size bytes. A frame is sent when it's full,
+// when flush_tx is called or when its oldest byte is older than max_latency (checked in add_tx_packet and process_tx).
+//RX: the frames are parsed back from the decoded byte stream. Every frame is compressed independently and starts with
+// a small header so after a lost datagram the decompressor drops the broken frame and resyncs on the next one.
+//
+//Compression is on the byte stream, not on packets - the same as the Fec_Encoder, packet boundaries are not preserved.
+class Compressor
+{
+public:
+    Compressor();
+    ~Compressor();
+
+    typedef std::chrono::high_resolution_clock Clock;
+
+    static const size_t MAX_FRAME_SIZE = 60000; //so the compressed size of incompressible frames still fits in 16 bits
+
+    struct Descriptor
+    {
+        //zlib level, 1 is fastest and usually good enough for text
+        int level = 1;
+
+        //uncompressed bytes per frame. Bigger frames compress better but a lost datagram costs more data
+        size_t max_frame_size = 8192;
+
+        //TX only. Data doesn't wait in a frame longer than this
+        Clock::duration max_latency = std::chrono::milliseconds(20);
+    };
+
+    bool init_tx(Descriptor const& descriptor);
+    bool init_rx(Descriptor const& descriptor);
+
+    //add un-compressed data here
+    bool add_tx_packet(void const* data, size_t size);
+
+    //sends the pending frame now
+    bool flush_tx();
+
+    //call this periodically, sends the pending frame if it's older than max_latency
+    bool process_tx();
+
+    //sync, compressed frames will be ready here. Feed these to Fec_Encoder::add_tx_packet
+    std::function<void(void const* data, size_t size)> on_tx_data_compressed;
+
+    //add the decoded data here (from Fec_Encoder::on_rx_data_decoded)
+    bool add_rx_packet(void const* data, size_t size);
+
+    //sync, the decompressed data will be ready here
+    std::function<void(void const* data, size_t size)> on_rx_data_decompressed;
+
+private:
+    bool compress_frame();
+    void decompress_frames();
+
+    struct Frame_Header;
+    bool is_frame_header_valid(Frame_Header const& header) const;
+    bool inflate_frame(size_t offset, Frame_Header const& header);
+    size_t find_complete_frame(size_t offset); //m_input.size() if there's none
+
+    bool m_is_tx = false;
+    Descriptor m_descriptor;
+
+    struct Impl;
+    std::unique_ptr<Impl> m_impl;
+
+    std::vector<uint8_t> m_input;
+    std::vector<uint8_t> m_output;
+    Clock::time_point m_frame_start_tp = Clock::now();
+
+    size_t m_frames = 0;
+    size_t m_broken_frames = 0;
+};
+
@@ -7,8 +7,15 @@
 #include <algorithm>
 #include <cassert>
 #include <cstring>
+#include <random>
+#include <climits>
+#include <cstdlib>
+#include <new>
 #include "Pool.h"
+#include "Spsc_Queue.h"
 #include "utils/fec.h"
+#include "utils/chacha20_poly1305.h"
+#include "utils/crc32c.h"
 
 static constexpr unsigned BLOCK_NUMS[] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9,
                                            10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 20,
@@ -16,21 +23,59 @@ static constexpr unsigned BLOCK_NUMS[] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9,
 
 const uint8_t Fec_Encoder::MAX_CODING_K;
 const uint8_t Fec_Encoder::MAX_CODING_N;
+const size_t Fec_Encoder::MAX_INTERLEAVING_DEPTH;
 const size_t Fec_Encoder::PAYLOAD_OVERHEAD;
+const size_t Fec_Encoder::ENCRYPTION_KEY_SIZE;
+const size_t Fec_Encoder::ENCRYPTION_OVERHEAD;
+const size_t Fec_Encoder::MAX_RECEIVERS;
+const size_t Fec_Encoder::SESSION_SWITCH_DATAGRAMS;
+const uint32_t Fec_Encoder::BLOCK_INDEX_MASK;
+const size_t Fec_Encoder::HISTOGRAM_SIZE;
 
-#pragma pack(push, 1)
+typedef Fec_Encoder::Datagram_Header Datagram_Header;
 
-struct Datagram_Header
+static_assert(Fec_Encoder::PAYLOAD_OVERHEAD == sizeof(Datagram_Header), "Check the PAYLOAD_OVERHEAD size");
+static_assert(Fec_Encoder::ENCRYPTION_KEY_SIZE == CHACHA20_POLY1305_KEY_SIZE, "Check the ENCRYPTION_KEY_SIZE");
+static_assert(Fec_Encoder::ENCRYPTION_OVERHEAD == sizeof(uint32_t) + CHACHA20_POLY1305_TAG_SIZE, "Check the ENCRYPTION_OVERHEAD size");
+
+//The live counters behind Stats. Each one is written by a single thread (the coding thread, the caller's in
+// synchronous mode) and read by anyone so relaxed atomics are enough
+struct Stats_Counters
 {
-//    uint32_t crc = 0;
-    uint32_t block_index : 24;
-    uint32_t datagram_index : 8;
-    uint16_t size : 16;
-};
+    Stats_Counters()
+    {
+        for (std::atomic<size_t>& c: fec_used_histogram) { c = 0; }
+        for (std::atomic<size_t>& c: decode_time_histogram) { c = 0; }
+        for (std::atomic<size_t>& c: block_latency_histogram) { c = 0; }
+    }
 
-#pragma pack(pop)
+    std::atomic<size_t> datagrams_received = { 0 };
+    std::atomic<size_t> datagrams_duplicated = { 0 };
+    std::atomic<size_t> datagrams_out_of_window = { 0 };
+    std::atomic<size_t> datagrams_rejected = { 0 };
+    std::atomic<size_t> datagrams_corrupted = { 0 };
+    std::atomic<size_t> datagrams_lost = { 0 };
+    std::atomic<size_t> blocks_complete = { 0 };
+    std::atomic<size_t> blocks_recovered = { 0 };
+    std::atomic<size_t> blocks_skipped = { 0 };
+    std::atomic<size_t> data_decoded = { 0 };
+    std::array<std::atomic<size_t>, Fec_Encoder::MAX_CODING_K + 1> fec_used_histogram;
+    std::array<std::atomic<size_t>, Fec_Encoder::HISTOGRAM_SIZE> decode_time_histogram;
+    std::array<std::atomic<size_t>, Fec_Encoder::HISTOGRAM_SIZE> block_latency_histogram;
+
+    struct Receiver
+    {
+        std::atomic<size_t> datagrams_received = { 0 };
+        std::atomic<size_t> datagrams_duplicated = { 0 };
+        std::atomic<size_t> datagrams_used = { 0 };
+        std::atomic<size_t> datagrams_exclusive = { 0 };
+    };
+    std::array<Receiver, Fec_Encoder::MAX_RECEIVERS> receivers;
 
-static_assert(Fec_Encoder::PAYLOAD_OVERHEAD == sizeof(Datagram_Header), "Check the PAYLOAD_OVERHEAD size");
+    std::atomic<size_t> blocks_encoded = { 0 };
+    std::atomic<size_t> datagrams_sent = { 0 };
+    std::atomic<size_t> data_encoded = { 0 };
+};
 
 //A     B       C       D       E       F
 //A     Bx      Cx      Dx      Ex      Fx
@@ -44,6 +89,7 @@ struct Fec_Encoder::TX
     struct Datagram
     {
         std::vector<uint8_t> data;
+        uint64_t sequence_number = 0; //in the queue, a gap means drop_oldest (or a full queue) dropped some
     };
     typedef Pool<Datagram>::Ptr Datagram_ptr;
 
@@ -54,10 +100,25 @@ struct Fec_Encoder::TX
     Queue<Datagram_ptr> datagram_queue;
     ////////
 
+    uint64_t next_queued_sequence_number = 0; //main thread only
+    uint64_t next_popped_sequence_number = 0; //TX thread only
+
+    struct Block
+    {
+        uint32_t block_index = 0;
+
+        std::vector<Datagram_ptr> datagrams;
+        std::vector<Datagram_ptr> fec_datagrams;
+    };
+
     ////////
-    //these live in the TX thread only
-    std::vector<Datagram_ptr> block_datagrams;
-    std::vector<Datagram_ptr> block_fec_datagrams;
+    //these live in the TX thread only (or the caller's thread when synchronous)
+    std::vector<Block> blocks; //one per interleaving slot
+    size_t crt_block = 0;
+
+    std::deque<Datagram_ptr> pending_fec_datagrams; //held back to be spread between the next primaries
+    size_t primaries_since_fec = 0;
+    Clock::time_point last_datagram_tp = Clock::now(); //synchronous only, for the fec_flush_timeout
     ///////
 
     Datagram_ptr crt_datagram;
@@ -66,58 +127,251 @@ struct Fec_Encoder::TX
 };
 
 
+struct Fec_Encoder::RX_Datagram
+{
+    uint32_t block_index = 0;
+    uint32_t datagram_index = 0;
+    uint8_t coding_k = 0;
+    uint8_t coding_n = 0;
+    uint16_t session_id = 0;
+    uint8_t receiver = 0;
+    int rssi = 0;
+    Datagram_Header header; //as received, the fields above are parsed from it
+    std::vector<uint8_t> data;
+};
+
 struct Fec_Encoder::RX
 {
     RX(size_t max_queue_length)
         : datagram_queue(max_queue_length)
     {}
 
-    struct Datagram
-    {
-        bool is_processed = false;
-        uint32_t block_index = 0;
-        uint32_t datagram_index = 0;
-        std::vector<uint8_t> data;
-    };
+    typedef RX_Datagram Datagram;
     typedef Pool<Datagram>::Ptr Datagram_ptr;
 
     Pool<Datagram> datagram_pool;
 
     ////////
-    //These are accessed by both the RX thread and the main thread
-    Queue<Datagram_ptr> datagram_queue;
+    //These are accessed by both the RX thread and the main thread.
+    //The receive loop is the only producer and the RX thread the only consumer so the handoff is lock free.
+    //The datagrams themselves still come from datagram_pool, which takes its mutex to acquire and release them
+    static const size_t MAX_QUEUE_LENGTH = 1024;
+    Spsc_Queue<Datagram_ptr, MAX_QUEUE_LENGTH> datagram_queue;
     ////////
 
     struct Block
     {
-        uint32_t block_index = 0;
+        uint32_t block_index = 0; //which block the slot holds, valid only while its bit is set in used_mask
+        uint8_t coding_k = 0;
+        uint8_t coding_n = 0;
+        Clock::time_point first_tp; //when its first datagram came in
+
+        uint32_t received_mask = 0; //bit i set when datagrams[i] holds datagram i, primary or fec
+        uint32_t processed_mask = 0; //bit i set when primary i was delivered
+        uint64_t stream_offset = 0; //of its first primary, valid with is_offset_known
+        bool is_offset_known = false;
+        std::array<Datagram_ptr, MAX_CODING_N> datagrams;
+        std::array<uint8_t, MAX_CODING_N> receiver_masks = {}; //bit r set in [i] when receiver r got datagram i
+    };
 
-        std::vector<Datagram_ptr> datagrams;
-        std::vector<Datagram_ptr> fec_datagrams;
+    //The blocks in flight, in a ring indexed by block_index % WINDOW_SIZE. They are all in
+    // [next_block_index, next_block_index + WINDOW_SIZE) (modulo BLOCK_INDEX_MASK + 1) so two of them never share a slot.
+    //The ring size divides 2^24 so the slot of a block doesn't change when the index wraps around.
+    static const size_t WINDOW_SIZE = 64;
+    std::array<Block, WINDOW_SIZE> blocks;
+    uint64_t used_mask = 0; //bit i is set while blocks[i] holds a block
+
+    Block* find_block(uint32_t block_index)
+    {
+        size_t slot = block_index & (WINDOW_SIZE - 1);
+        return (used_mask & (uint64_t(1) << slot)) && blocks[slot].block_index == block_index ? &blocks[slot] : nullptr;
+    }
+
+    Block& add_block(uint32_t block_index, uint8_t coding_k, uint8_t coding_n)
+    {
+        size_t slot = block_index & (WINDOW_SIZE - 1);
+        assert(!(used_mask & (uint64_t(1) << slot)));
+        used_mask |= uint64_t(1) << slot;
+        Block& block = blocks[slot];
+        block.block_index = block_index;
+        block.coding_k = coding_k;
+        block.coding_n = coding_n;
+        block.first_tp = Clock::now();
+        return block;
+    }
+
+    //the block with the smallest index, the next one to be delivered
+    Block* get_oldest_block()
+    {
+        return get_oldest_block(used_mask);
+    }
+
+    //the one waiting right behind the oldest block
+    Block* get_second_oldest_block()
+    {
+        Block* oldest = get_oldest_block(used_mask);
+        return oldest ? get_oldest_block(used_mask & ~(uint64_t(1) << (oldest->block_index & (WINDOW_SIZE - 1)))) : nullptr;
+    }
+
+    Block* get_oldest_block(uint64_t mask)
+    {
+        if (mask == 0)
+        {
+            return nullptr;
+        }
+        size_t start = next_block_index & (WINDOW_SIZE - 1);
+        if (start != 0)
+        {
+            mask = (mask >> start) | (mask << (WINDOW_SIZE - start));
+        }
+        return &blocks[(start + __builtin_ctzll(mask)) & (WINDOW_SIZE - 1)];
+    }
+
+    size_t get_block_count() const
+    {
+        return __builtin_popcountll(used_mask);
+    }
+
+    //the slot is free again and the block index won't be accepted anymore
+    void retire_block(Block& block, Stats_Counters& stats)
+    {
+        used_mask &= ~(uint64_t(1) << (block.block_index & (WINDOW_SIZE - 1)));
+        Retired_Block& retired = retired_blocks[block.block_index & (WINDOW_SIZE - 1)];
+        count_exclusive(retired, stats);
+        retired.block_index = block.block_index;
+        for (uint32_t mask = block.received_mask; mask != 0; mask &= mask - 1)
+        {
+            size_t i = __builtin_ctz(mask);
+
+            //what each receiver contributed. Datagrams rebuilt with fec weren't received by anyone
+            uint8_t receiver_mask = block.receiver_masks[i];
+            if (receiver_mask != 0)
+            {
+                uint8_t receiver = block.datagrams[i]->receiver;
+                stats.receivers[receiver].datagrams_used.fetch_add(1, std::memory_order_relaxed);
+                if ((receiver_mask & (receiver_mask - 1)) == 0)
+                {
+                    retired.exclusive_mask |= 1u << i;
+                    retired.receivers[i] = receiver;
+                }
+                block.receiver_masks[i] = 0;
+            }
+            block.datagrams[i].reset();
+        }
+        block.received_mask = 0;
+        block.processed_mask = 0;
+        block.is_offset_known = false;
+        next_block_index = (block.block_index + 1) & BLOCK_INDEX_MASK;
+        next_stream_block_index = next_block_index;
+        is_stream_started = true;
+    }
+
+    //A datagram only one receiver got is exclusive, but the copies from the other receivers can still come in after
+    // its block retired. So it's counted a window of blocks later, unless one of them showed up in the meantime
+    struct Retired_Block
+    {
+        uint32_t block_index = 0;
+        uint32_t exclusive_mask = 0; //bit i set while only one receiver got datagram i
+        std::array<uint8_t, MAX_CODING_N> receivers = {}; //which one, for the bits in exclusive_mask
     };
-    typedef Pool<Block>::Ptr Block_ptr;
+    std::array<Retired_Block, WINDOW_SIZE> retired_blocks;
+
+    void count_exclusive(Retired_Block& retired, Stats_Counters& stats)
+    {
+        for (uint32_t mask = retired.exclusive_mask; mask != 0; mask &= mask - 1)
+        {
+            stats.receivers[retired.receivers[__builtin_ctz(mask)]].datagrams_exclusive.fetch_add(1, std::memory_order_relaxed);
+        }
+        retired.exclusive_mask = 0;
+    }
 
-    Pool<Block> block_pool;
-    std::deque<Block_ptr> block_queue;
+    //a datagram for a block already done with
+    void add_late_datagram(uint32_t block_index, uint32_t datagram_index, uint8_t receiver)
+    {
+        Retired_Block& retired = retired_blocks[block_index & (WINDOW_SIZE - 1)];
+        if (retired.block_index == block_index && retired.receivers[datagram_index] != receiver)
+        {
+            retired.exclusive_mask &= ~(1u << datagram_index);
+        }
+    }
 
     Clock::time_point last_block_tp = Clock::now();
     Clock::time_point last_datagram_tp = Clock::now();
 
-    std::atomic_uint next_block_index = { 0 };
+    uint32_t next_block_index = 0;
+
+    //Where the output is in the stream, for the offsets of the delivered and lost data. Blocks retire in order so
+    // any block between next_stream_block_index and the next one retired was lost entirely
+    uint64_t stream_offset = 0; //the data delivered or lost so far, up to the end of the last block retired
+    uint32_t next_stream_block_index = 0;
+    bool is_stream_started = false; //false until the first block of a session is done with
+
+    //Until then the offsets count from the oldest block in the window, and once one is handed out from the block it was
+    // computed with. A block older than that would overlap the data already delivered so it's not accepted anymore
+    uint32_t stream_anchor_block_index = 0;
+    bool is_stream_anchored = false;
+
+    //The decoded datagrams waiting for on_rx_data_decoded_iov, delivered at the end of each pass (or before a loss
+    // report or a gap in the stream). The Data_ptrs keep the buffers alive until then
+    std::vector<Data_ptr> output_batch;
+    std::vector<iovec> output_batch_iov;
+    uint64_t output_batch_offset = 0;
+    size_t output_batch_size = 0;
+
+    uint16_t session_id = 0; //of the TX we're receiving from, 0 until the first datagram
+    uint16_t previous_session_id = 0; //its late datagrams are dropped instead of starting yet another session
+    Clock::time_point last_session_datagram_tp = Clock::now(); //the last one from session_id, usable or not
+    uint16_t candidate_session_id = 0; //another session seen while this one is alive, see SESSION_SWITCH_DATAGRAMS
+    size_t candidate_datagrams = 0;
 };
 
+const size_t Fec_Encoder::RX::WINDOW_SIZE;
+const size_t Fec_Encoder::RX::MAX_QUEUE_LENGTH;
 
-static void seal_datagram(Fec_Encoder::TX::Datagram& datagram, size_t header_offset, uint32_t block_index, uint8_t datagram_index)
+static_assert(Fec_Encoder::RX::WINDOW_SIZE == 64, "The window is tracked in a 64 bit mask");
+static_assert(Fec_Encoder::MAX_CODING_N <= 32, "The datagrams of a block are tracked in 32 bit masks");
+static_assert(Fec_Encoder::RX::WINDOW_SIZE > 2 * Fec_Encoder::MAX_INTERLEAVING_DEPTH + 1, "The window has to hold all the blocks in flight");
+
+
+static void seal_datagram(Fec_Encoder::TX::Datagram& datagram, size_t header_offset, uint8_t stream_id, uint16_t session_id, uint32_t block_index, uint8_t datagram_index, uint8_t coding_k, uint8_t coding_n, bool is_checksummed)
 {
     assert(datagram.data.size() >= header_offset + sizeof(Fec_Encoder::TX::Datagram));
 
     Datagram_Header& header = *reinterpret_cast<Datagram_Header*>(datagram.data.data() + header_offset);
-//    header.crc = 0;
+    header.crc = 0;
     header.size = datagram.data.size() - header_offset;
     header.block_index = block_index;
     header.datagram_index = datagram_index;
+    header.coding_k = coding_k;
+    header.coding_n = coding_n;
+    header.stream_id = stream_id;
+    header.session_id = session_id;
+
+    if (is_checksummed)
+    {
+        size_t payload_offset = header_offset + sizeof(Datagram_Header);
+        header.crc = Fec_Encoder::get_datagram_crc(header, datagram.data.data() + payload_offset, datagram.data.size() - payload_offset);
+    }
+}
+
+static void add_stat(std::atomic<size_t>& counter, size_t value = 1)
+{
+    counter.fetch_add(value, std::memory_order_relaxed);
+}
+
+static void add_histogram_stat(std::atomic<size_t>* histogram, Fec_Encoder::Clock::duration duration)
+{
+    auto us = std::chrono::duration_cast<std::chrono::microseconds>(duration).count();
+    size_t bucket = us > 1 ? 63 - __builtin_clzll(static_cast<uint64_t>(us)) : 0;
+    add_stat(histogram[std::min(bucket, Fec_Encoder::HISTOGRAM_SIZE - 1)]);
+}
 
-//    header.crc = q::util::murmur_hash(datagram.data.data() + header_offset, header.size, 0);
+static void add_skipped_block_stats(Stats_Counters& stats, Fec_Encoder::RX::Block const& block)
+{
+    uint32_t primary_mask = (1u << block.coding_k) - 1;
+    add_stat(stats.blocks_skipped);
+    add_stat(stats.datagrams_lost, block.coding_k - __builtin_popcount(block.processed_mask & primary_mask));
+    add_histogram_stat(stats.block_latency_histogram.data(), Fec_Encoder::Clock::now() - block.first_tp);
 }
 
 struct Fec_Encoder::Impl
@@ -127,8 +381,24 @@ struct Fec_Encoder::Impl
         , rx(max_queue_length)
     {}
 
+    //The queues are cache line aligned and a C++11 new only guarantees the alignment of the fundamental types
+    static void* operator new(size_t size)
+    {
+        void* ptr = nullptr;
+        if (posix_memalign(&ptr, alignof(Impl), size) != 0)
+        {
+            throw std::bad_alloc();
+        }
+        return ptr;
+    }
+    static void operator delete(void* ptr)
+    {
+        free(ptr);
+    }
+
     TX tx;
     RX rx;
+    Stats_Counters stats;
 };
 
 ////////////////////////////////////////////////////////////////////////////////////////////
@@ -142,29 +412,35 @@ Fec_Encoder::Fec_Encoder()
 Fec_Encoder::~Fec_Encoder()
 {
     m_exit = true;
-    m_impl->tx.datagram_queue.exit();
-    m_impl->rx.datagram_queue.exit();
+    if (m_impl)
+    {
+        m_impl->tx.datagram_queue.exit();
+        m_impl->rx.datagram_queue.exit();
+    }
     if (m_thread.joinable())
     {
         m_thread.join();
     }
 
-    if (m_fec)
+    for (fec_t* fec: m_fecs)
     {
-        fec_free(m_fec);
+        if (fec)
+        {
+            fec_free(fec);
+        }
     }
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////
 
-bool Fec_Encoder::add_rx_packet(void const* _data, size_t size, bool block)
+bool Fec_Encoder::add_rx_packet(void const* _data, size_t size, bool block, size_t receiver, int rssi)
 {
     if (m_exit)
     {
         return false;
     }
 
-    if (!_data || size == 0)
+    if (!_data || size == 0 || receiver >= MAX_RECEIVERS)
     {
         return false;
     }
@@ -172,25 +448,134 @@ bool Fec_Encoder::add_rx_packet(void const* _data, size_t size, bool block)
     RX& rx = m_impl->rx;
     uint8_t const* data = reinterpret_cast<uint8_t const*>(_data);
 
+    if (size < sizeof(Datagram_Header))
+    {
+        return true;
+    }
+
     const Datagram_Header& header = *reinterpret_cast<const Datagram_Header*>(data);
-    uint32_t block_index = header.block_index;
-    uint32_t datagram_index = header.datagram_index;
-    if (datagram_index >= m_coding_n)
+    if (!is_rx_header_valid(header, size))
     {
-        //QLOGE("datagram index out of range: {} > {}", datagram_index, m_coding_n);
+        return true;
+    }
+    if (!is_datagram_intact(header, data + sizeof(Datagram_Header), size - sizeof(Datagram_Header)))
+    {
+        add_stat(m_impl->stats.datagrams_corrupted);
         return true;
     }
 
     {
         RX::Datagram_ptr datagram = rx.datagram_pool.acquire();
-        datagram->data.resize(size - sizeof(Datagram_Header));
-        datagram->block_index = block_index;
-        datagram->datagram_index = datagram_index;
+        datagram->block_index = header.block_index;
+        datagram->datagram_index = header.datagram_index;
+        datagram->coding_k = header.coding_k;
+        datagram->coding_n = header.coding_n;
+        datagram->session_id = header.session_id;
+        datagram->receiver = receiver;
+        datagram->rssi = rssi;
         memcpy(datagram->data.data(), data + sizeof(Datagram_Header), size - sizeof(Datagram_Header));
 
-        rx.datagram_queue.push_back(datagram, block);
+        if (get_descriptor().is_synchronous)
+        {
+            process_rx_datagram(rx, datagram);
+            process_rx(rx);
+        }
+        else
+        {
+            rx.datagram_queue.push_back(datagram, block);
+        }
+    }
+
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+bool Fec_Encoder::acquire_rx_buffer(RX_Buffer& buffer)
+{
+    if (m_exit || !m_impl || m_is_tx)
+    {
+        return false;
+    }
+
+    RX::Datagram_ptr datagram = m_impl->rx.datagram_pool.acquire();
+    buffer.iov[0].iov_base = &datagram->header;
+    buffer.iov[0].iov_len = sizeof(Datagram_Header);
+    buffer.iov[1].iov_base = datagram->data.data();
+    buffer.iov[1].iov_len = datagram->data.size();
+    buffer.datagram = datagram;
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+bool Fec_Encoder::add_rx_buffer(RX_Buffer& buffer, size_t size, bool block)
+{
+    RX::Datagram_ptr datagram = std::static_pointer_cast<RX::Datagram>(buffer.datagram);
+    buffer.datagram.reset();
+    if (m_exit)
+    {
+        return false;
+    }
+    if (!datagram || buffer.receiver >= MAX_RECEIVERS)
+    {
+        return false;
+    }
+
+    //the header and the payload are already where they belong, only the header needs checking
+    Datagram_Header const& header = datagram->header;
+    if (!is_rx_header_valid(header, size))
+    {
+        return true;
+    }
+    if (!is_datagram_intact(header, datagram->data.data(), datagram->data.size()))
+    {
+        add_stat(m_impl->stats.datagrams_corrupted);
+        return true;
+    }
+
+    datagram->block_index = header.block_index;
+    datagram->datagram_index = header.datagram_index;
+    datagram->coding_k = header.coding_k;
+    datagram->coding_n = header.coding_n;
+    datagram->session_id = header.session_id;
+    datagram->receiver = buffer.receiver;
+    datagram->rssi = buffer.rssi;
+    if (get_descriptor().is_synchronous)
+    {
+        process_rx_datagram(m_impl->rx, datagram);
+        process_rx(m_impl->rx);
+    }
+    else
+    {
+        m_impl->rx.datagram_queue.push_back(datagram, block);
     }
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
 
+bool Fec_Encoder::is_rx_header_valid(Datagram_Header const& header, size_t size) const
+{
+    if (header.stream_id != m_rx_descriptor.stream_id)
+    {
+        return false;
+    }
+    if (!are_coding_params_valid(header.coding_k, header.coding_n))
+    {
+        //QLOGE("invalid coding params: {} / {}", header.coding_k, header.coding_n);
+        return false;
+    }
+    if (header.datagram_index >= header.coding_n)
+    {
+        //QLOGE("datagram index out of range: {} > {}", header.datagram_index, header.coding_n);
+        return false;
+    }
+    if (size != m_transport_datagram_size)
+    {
+        //the TX only sends full datagrams and the decoder reads m_payload_size bytes from every one
+        return false;
+    }
     return true;
 }
 
@@ -230,17 +615,28 @@ bool Fec_Encoder::init_rx(RX_Descriptor const& descriptor)
 
 bool Fec_Encoder::init()
 {
-    if (m_coding_k == 0 || m_coding_n < m_coding_k || m_coding_k > m_fec_src_datagram_ptrs.size() || m_coding_n > m_fec_dst_datagram_ptrs.size())
+    if (!are_coding_params_valid(m_coding_k, m_coding_n))
     {
         //QLOGE("Invalid coding params: {} / {}" , m_coding_k, m_coding_n);
         return false;
     }
 
-    if (m_fec)
+    size_t interleaving_depth = get_descriptor().interleaving_depth;
+    if (interleaving_depth == 0 || interleaving_depth > MAX_INTERLEAVING_DEPTH)
+    {
+        //QLOGE("Invalid interleaving depth: {}" , interleaving_depth);
+        return false;
+    }
+    if (!m_is_tx && m_rx_descriptor.max_blocks >= RX::WINDOW_SIZE)
     {
-        fec_free(m_fec);
+        //QLOGE("Too many blocks in flight: {}" , m_rx_descriptor.max_blocks);
+        return false;
+    }
+    if (!m_is_tx && m_rx_descriptor.max_enqueued_packets > RX::MAX_QUEUE_LENGTH)
+    {
+        //QLOGE("Too many enqueued packets: {}" , m_rx_descriptor.max_enqueued_packets);
+        return false;
     }
-    m_fec = fec_new(m_coding_k, m_coding_n);
 
 
     /////////////////////
@@ -251,49 +647,104 @@ bool Fec_Encoder::init()
     m_payload_size = get_mtu();
     /////////////////////
 
-
-    m_impl->tx.datagram_pool.on_acquire = [this](TX::Datagram& datagram)
+    std::vector<uint8_t> const& key = get_descriptor().encryption_key;
+    m_is_encrypted = !key.empty();
+    if (m_is_encrypted)
     {
-        if (datagram.data.size() < m_payload_offset)
+        if (key.size() != ENCRYPTION_KEY_SIZE || m_payload_size <= ENCRYPTION_OVERHEAD)
         {
-            datagram.data.resize(m_payload_offset);
+            //QLOGE("Invalid encryption key size {} or mtu too small", key.size());
+            return false;
         }
+        std::copy(key.begin(), key.end(), m_encryption_key.begin());
+        m_encryption_salt = std::random_device()();
+    }
+    m_data_size = m_payload_size - (m_is_encrypted ? ENCRYPTION_OVERHEAD : 0);
+    m_session_id = generate_session_id();
+
+
+    m_impl->tx.datagram_pool.on_acquire = [this](TX::Datagram& datagram)
+    {
+        //recycled datagrams come back full, make room for the header only
+        datagram.data.resize(m_payload_offset);
     };
 
     m_impl->rx.datagram_pool.on_acquire = [this](RX::Datagram& datagram)
     {
         datagram.block_index = 0;
         datagram.datagram_index = 0;
-        datagram.is_processed = false;
-        datagram.data.clear();
-        datagram.data.reserve(m_transport_datagram_size);
+        datagram.coding_k = 0;
+        datagram.coding_n = 0;
+        datagram.session_id = 0;
+        datagram.receiver = 0;
+        datagram.rssi = 0;
+
+        //payload sized so a received packet can go straight in. Recycled datagrams mostly have the size already
+        // and don't get zeroed again
+        datagram.data.resize(m_payload_size);
     };
-    m_impl->rx.block_pool.on_acquire = [this](RX::Block& block)
+    if (m_is_tx)
     {
-        block.block_index = 0;
+        TX& tx = m_impl->tx;
+        if (m_tx_descriptor.drop_oldest)
+        {
+            //a block worth at a time so the receiver loses whole blocks of stale data, not a bit of every block
+            tx.datagram_queue.set_drop_oldest(m_coding_k);
+        }
 
-        block.datagrams.clear();
-        block.datagrams.reserve(m_coding_k);
+        tx.blocks.resize(interleaving_depth);
+        for (TX::Block& block: tx.blocks)
+        {
+            block.block_index = tx.last_block_index;
+            tx.last_block_index = (tx.last_block_index + 1) & BLOCK_INDEX_MASK;
+            block.datagrams.reserve(m_coding_k);
+            block.fec_datagrams.reserve(m_coding_n - m_coding_k);
+        }
 
-        block.fec_datagrams.clear();
-        block.fec_datagrams.reserve(m_coding_n - m_coding_k);
-    };
-    m_impl->rx.block_pool.on_release = [this](RX::Block& block)
+        if (!m_tx_descriptor.is_synchronous)
+        {
+            m_thread = std::thread([this]() { tx_thread_proc(); });
+        }
+    }
+    else if (!m_rx_descriptor.is_synchronous)
     {
-        block.datagrams.clear();
-        block.fec_datagrams.clear();
-    };
+        m_thread = std::thread([this]() { rx_thread_proc(); });
+    }
+
+    return true;
+}
 
+////////////////////////////////////////////////////////////////////////////////////////////
 
-    if (m_is_tx)
+bool Fec_Encoder::are_coding_params_valid(uint8_t coding_k, uint8_t coding_n)
+{
+    return coding_k > 0 && coding_n >= coding_k && coding_k <= MAX_CODING_K && coding_n <= MAX_CODING_N;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+fec_t* Fec_Encoder::get_fec(uint8_t coding_k, uint8_t coding_n)
+{
+    assert(are_coding_params_valid(coding_k, coding_n));
+
+    fec_t*& fec = m_fecs[(coding_k - 1) * MAX_CODING_N + (coding_n - 1)];
+    if (!fec)
     {
-        m_thread = std::thread([this]() { tx_thread_proc(); });
+        fec = fec_new(coding_k, coding_n);
     }
-    else
+    return fec;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+bool Fec_Encoder::set_coding_params(uint8_t coding_k, uint8_t coding_n)
+{
+    if (!m_is_tx || !are_coding_params_valid(coding_k, coding_n))
     {
-        m_thread = std::thread([this]() { rx_thread_proc(); });
+        return false;
     }
 
+    m_pending_coding_params = (uint16_t(coding_k) << 8) | coding_n;
     return true;
 }
 
@@ -306,80 +757,280 @@ Fec_Encoder::Descriptor const& Fec_Encoder::get_descriptor() const
 
 ////////////////////////////////////////////////////////////////////////////////////////////
 
-void Fec_Encoder::tx_thread_proc()
+void Fec_Encoder::encode_tx_block(TX& tx, size_t block_idx)
 {
-    TX& tx = m_impl->tx;
+    TX::Block& block = tx.blocks[block_idx];
 
-    while (!m_exit)
+    //auto start = Clock::now();
+
+    //init data for the fec_encode
+    for (size_t i = 0; i < m_coding_k; i++)
     {
-        size_t start = tx.block_datagrams.size();
-        tx.datagram_queue.pop_front(tx.block_datagrams, m_coding_k, true);
+        TX::Datagram_ptr const& datagram = block.datagrams[i];
+        m_fec_src_datagram_ptrs[i] = datagram->data.data() + m_payload_offset;
+    }
 
-        //seal and send the newly added ones
-        for (size_t i = start; i < tx.block_datagrams.size(); i++)
-        {
-            TX::Datagram_ptr datagram = tx.block_datagrams[i];
-            seal_datagram(*datagram, m_datagram_header_offset, tx.last_block_index, i);
-            if (on_tx_data_encoded)
-            {
-                on_tx_data_encoded(datagram->data.data(), datagram->data.size());
-            }
-        }
+    size_t fec_count = m_coding_n - m_coding_k;
+    block.fec_datagrams.resize(fec_count);
+    for (size_t i = 0; i < fec_count; i++)
+    {
+        block.fec_datagrams[i] = tx.datagram_pool.acquire();
+        block.fec_datagrams[i]->data.resize(m_transport_datagram_size);
+        m_fec_dst_datagram_ptrs[i] = block.fec_datagrams[i]->data.data() + m_payload_offset;
+    }
 
-        //compute fec datagrams
-        if (tx.block_datagrams.size() >= m_coding_k)
-        {
-            if (1)
-            {
-                //auto start = Clock::now();
+    //encode
+    fec_encode(get_fec(m_coding_k, m_coding_n), m_fec_src_datagram_ptrs.data(), m_fec_dst_datagram_ptrs.data(), BLOCK_NUMS + m_coding_k, m_coding_n - m_coding_k, m_payload_size);
 
-                //init data for the fec_encode
-                for (size_t i = 0; i < m_coding_k; i++)
-                {
-                    TX::Datagram_ptr datagram = tx.block_datagrams[i];
-                    m_fec_src_datagram_ptrs[i] = datagram->data.data() + m_payload_offset;
-                }
+    //seal the result
+    for (size_t i = 0; i < fec_count; i++)
+    {
+        seal_datagram(*block.fec_datagrams[i], m_datagram_header_offset, m_tx_descriptor.stream_id, m_session_id, block.block_index, m_coding_k + i, m_coding_k, m_coding_n, m_tx_descriptor.is_checksummed);
+    }
 
-                size_t fec_count = m_coding_n - m_coding_k;
-                tx.block_fec_datagrams.resize(fec_count);
-                for (size_t i = 0; i < fec_count; i++)
-                {
-                    tx.block_fec_datagrams[i] = tx.datagram_pool.acquire();
-                    tx.block_fec_datagrams[i]->data.resize(m_transport_datagram_size);
-                    m_fec_dst_datagram_ptrs[i] = tx.block_fec_datagrams[i]->data.data() + m_payload_offset;
-                }
+    add_stat(m_impl->stats.blocks_encoded);
 
-                //encode
-                fec_encode(m_fec, m_fec_src_datagram_ptrs.data(), m_fec_dst_datagram_ptrs.data(), BLOCK_NUMS + m_coding_k, m_coding_n - m_coding_k, m_payload_size);
+    //QLOGI("Encoded fec: {}", Clock::now() - start);
+}
 
-                //seal the result
-                for (size_t i = 0; i < fec_count; i++)
-                {
-                    seal_datagram(*tx.block_fec_datagrams[i], m_datagram_header_offset, tx.last_block_index, m_coding_k + i);
+////////////////////////////////////////////////////////////////////////////////////////////
 
-                    if (on_tx_data_encoded)
-                    {
-                        TX::Datagram& datagram = *tx.block_fec_datagrams[i];
-                        on_tx_data_encoded(datagram.data.data(), datagram.data.size());
-                    }
-                }
+void Fec_Encoder::push_output(Data_ptr const& data)
+{
+    Output_Ring& ring = *get_descriptor().output_ring;
 
-                //QLOGI("Encoded fec: {}", Clock::now() - start);
-            }
+    //the consumer is behind, wait for it just like a slow callback would stall us
+    while (!ring.try_push(data) && !m_exit)
+    {
+        std::this_thread::yield();
+    }
+}
 
-            tx.block_datagrams.clear();
-            tx.block_fec_datagrams.clear();
-            tx.last_block_index++;
-        }
+////////////////////////////////////////////////////////////////////////////////////////////
 
-        {
-            //std::this_thread::sleep_for(std::chrono::milliseconds(1));
-            //std::this_thread::yield();
+void Fec_Encoder::send_tx_datagram(Data_ptr const& data)
+{
+    add_stat(m_impl->stats.datagrams_sent);
+    if (m_tx_descriptor.output_ring)
+    {
+        push_output(data);
+    }
+    else if (on_tx_data_encoded)
+    {
+        on_tx_data_encoded(data->data(), data->size());
+    }
+}
 
-#ifdef DEBUG_THROUGHPUT
-            {
-                static size_t xxx_data = 0;
-                static size_t xxx_real_data = 0;
+////////////////////////////////////////////////////////////////////////////////////////////
+
+void Fec_Encoder::send_tx_primary(TX& tx, Data_ptr const& data)
+{
+    send_tx_datagram(data);
+
+    //spread the held back fec datagrams of the previous block(s) between the primaries of the current one
+    if (!tx.pending_fec_datagrams.empty() && ++tx.primaries_since_fec >= m_tx_descriptor.fec_spread)
+    {
+        TX::Datagram_ptr const& datagram = tx.pending_fec_datagrams.front();
+        send_tx_datagram(Data_ptr(datagram, &datagram->data));
+        tx.pending_fec_datagrams.pop_front();
+        tx.primaries_since_fec = 0;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+void Fec_Encoder::flush_tx_fec(TX& tx)
+{
+    for (TX::Datagram_ptr const& datagram: tx.pending_fec_datagrams)
+    {
+        send_tx_datagram(Data_ptr(datagram, &datagram->data));
+    }
+    tx.pending_fec_datagrams.clear();
+    tx.primaries_since_fec = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+void Fec_Encoder::send_tx_blocks(TX& tx)
+{
+    //With interleaving the primaries were held back until now. They go round-robin between the blocks:
+    // datagram 0 of every block, then datagram 1 of every block etc.
+    if (tx.blocks.size() > 1)
+    {
+        for (size_t i = 0; i < m_coding_k; i++)
+        {
+            for (TX::Block const& block: tx.blocks)
+            {
+                TX::Datagram_ptr const& datagram = block.datagrams[i];
+                send_tx_primary(tx, Data_ptr(datagram, &datagram->data));
+            }
+        }
+    }
+
+    //the previous blocks have to be complete before the fec datagrams of the new ones start
+    flush_tx_fec(tx);
+
+    for (size_t i = 0; i < size_t(m_coding_n - m_coding_k); i++)
+    {
+        for (TX::Block const& block: tx.blocks)
+        {
+            if (m_tx_descriptor.fec_spread > 0)
+            {
+                tx.pending_fec_datagrams.push_back(block.fec_datagrams[i]);
+            }
+            else
+            {
+                TX::Datagram_ptr const& datagram = block.fec_datagrams[i];
+                send_tx_datagram(Data_ptr(datagram, &datagram->data));
+            }
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+void Fec_Encoder::process_tx_block(TX& tx, size_t start)
+{
+    TX::Block& block = tx.blocks[tx.crt_block];
+
+    //without interleaving the datagrams are sent as soon as they are sealed
+    bool is_interleaved = tx.blocks.size() > 1;
+
+    //seal and send the newly added ones
+    for (size_t i = start; i < block.datagrams.size(); i++)
+    {
+        TX::Datagram_ptr const& datagram = block.datagrams[i];
+        if (m_is_encrypted)
+        {
+            //before sealing as the parity has to cover the ciphertext
+            encrypt_tx_datagram(block.block_index, i, datagram->data);
+        }
+        seal_datagram(*datagram, m_datagram_header_offset, m_tx_descriptor.stream_id, m_session_id, block.block_index, i, m_coding_k, m_coding_n, m_tx_descriptor.is_checksummed);
+        if (!is_interleaved)
+        {
+            send_tx_primary(tx, Data_ptr(datagram, &datagram->data));
+        }
+    }
+
+    //compute fec datagrams
+    if (block.datagrams.size() < m_coding_k)
+    {
+        return;
+    }
+
+    encode_tx_block(tx, tx.crt_block);
+    tx.crt_block++;
+
+    //wait until all the interleaved blocks are encoded
+    if (tx.crt_block < tx.blocks.size())
+    {
+        return;
+    }
+
+    send_tx_blocks(tx);
+    start_tx_blocks(tx);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+uint32_t Fec_Encoder::get_next_tx_block_index(TX& tx)
+{
+    uint32_t block_index = tx.last_block_index;
+    tx.last_block_index = (tx.last_block_index + 1) & BLOCK_INDEX_MASK;
+
+    //the block index is 24 bits on the wire so the nonces would repeat after it wraps
+    if (tx.last_block_index == 0)
+    {
+        m_encryption_salt = std::random_device()();
+    }
+    return block_index;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+void Fec_Encoder::start_tx_blocks(TX& tx)
+{
+    for (TX::Block& b: tx.blocks)
+    {
+        b.datagrams.clear();
+        b.fec_datagrams.clear();
+        b.block_index = get_next_tx_block_index(tx);
+    }
+    tx.crt_block = 0;
+
+    update_tx_coding_params(tx);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+void Fec_Encoder::restart_tx_block(TX& tx)
+{
+    //The current block gets a new index and the ones after it (still empty) move up by one, so exactly one block
+    // index never completes. The blocks before it in the interleaving group are kept and sent with the group
+    for (size_t i = tx.crt_block; i < tx.blocks.size(); i++)
+    {
+        TX::Block& b = tx.blocks[i];
+        b.datagrams.clear();
+        b.fec_datagrams.clear();
+        b.block_index = i + 1 < tx.blocks.size() ? tx.blocks[i + 1].block_index : get_next_tx_block_index(tx);
+    }
+
+    //nothing of the group is encoded yet, the same as a new group
+    if (tx.crt_block == 0)
+    {
+        update_tx_coding_params(tx);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+void Fec_Encoder::update_tx_coding_params(TX& tx)
+{
+    //new coding params are picked up between blocks (or groups of interleaved blocks) so there is no gap in the stream
+    uint16_t params = m_pending_coding_params.exchange(0);
+    if (params != 0)
+    {
+        m_coding_k = params >> 8;
+        m_coding_n = params & 0xFF;
+        if (m_tx_descriptor.drop_oldest)
+        {
+            tx.datagram_queue.set_drop_oldest(m_coding_k);
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+void Fec_Encoder::tx_thread_proc()
+{
+    TX& tx = m_impl->tx;
+
+    while (!m_exit)
+    {
+        TX::Block& block = tx.blocks[tx.crt_block];
+
+        size_t start = block.datagrams.size();
+        if (tx.pending_fec_datagrams.empty())
+        {
+            tx.datagram_queue.pop_front(block.datagrams, m_coding_k, true);
+        }
+        else if (!tx.datagram_queue.pop_front_timeout(block.datagrams, m_coding_k, m_tx_descriptor.fec_flush_timeout))
+        {
+            //the stream stalled, don't hold back the protection of the last block any longer
+            flush_tx_fec(tx);
+        }
+
+        start = skip_tx_gaps(tx, start);
+        process_tx_block(tx, start);
+
+        {
+            //std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            //std::this_thread::yield();
+
+#ifdef DEBUG_THROUGHPUT
+            {
+                static size_t xxx_data = 0;
+                static size_t xxx_real_data = 0;
                 static std::chrono::system_clock::time_point xxx_last_tp = std::chrono::system_clock::now();
                 xxx_data += tx_buffer.size();
                 xxx_real_data += MAX_USER_PACKET_SIZE;
@@ -401,7 +1052,49 @@ void Fec_Encoder::tx_thread_proc()
 
 ////////////////////////////////////////////////////////////////////////////////////////////
 
-bool Fec_Encoder::add_tx_packet(void const* _data, size_t size, bool block)
+size_t Fec_Encoder::skip_tx_gaps(TX& tx, size_t start)
+{
+    //Datagrams were dropped from the queue. The ones after the gap can't go in the same block as the ones before it
+    // or the receiver would get the stream spliced without knowing. The block in progress is given up on instead:
+    // what was sent of it and the block index it had never complete, so the receiver reports it lost.
+    //With interleaving the blocks of the group that are already encoded are kept, the after gap datagrams restart
+    // only the current one
+    TX::Block* block = &tx.blocks[tx.crt_block];
+    for (size_t i = start; i < block->datagrams.size(); i++)
+    {
+        if (block->datagrams[i]->sequence_number != tx.next_popped_sequence_number)
+        {
+            std::vector<TX::Datagram_ptr> after_gap(block->datagrams.begin() + i, block->datagrams.end());
+            block->datagrams.resize(i);
+            process_tx_block(tx, start);
+            restart_tx_block(tx);
+
+            //the coding params can change between blocks, what doesn't fit anymore makes another gap
+            after_gap.resize(std::min<size_t>(after_gap.size(), m_coding_k));
+            block = &tx.blocks[tx.crt_block];
+            block->datagrams.assign(after_gap.begin(), after_gap.end());
+            tx.next_popped_sequence_number = block->datagrams.front()->sequence_number;
+            start = 0;
+            i = 0;
+        }
+        tx.next_popped_sequence_number++;
+    }
+    return start;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+bool Fec_Encoder::add_tx_packet(void const* data, size_t size, bool block)
+{
+    iovec iov;
+    iov.iov_base = const_cast<void*>(data);
+    iov.iov_len = size;
+    return add_tx_packet(&iov, 1, block);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+bool Fec_Encoder::add_tx_packet(iovec const* iov, size_t count, bool block)
 {
     if (m_exit)
     {
@@ -411,35 +1104,153 @@ bool Fec_Encoder::add_tx_packet(void const* _data, size_t size, bool block)
     TX& tx = m_impl->tx;
 
     TX::Datagram_ptr& datagram = tx.crt_datagram;
+    for (size_t i = 0; i < count; i++)
+    {
+        add_stat(m_impl->stats.data_encoded, iov[i].iov_len);
+    }
 
-    uint8_t const* data = reinterpret_cast<uint8_t const*>(_data);
-
-    while (size > 0)
+    for (size_t i = 0; i < count; i++)
     {
-        if (!datagram)
+        uint8_t const* data = reinterpret_cast<uint8_t const*>(iov[i].iov_base);
+        size_t size = iov[i].iov_len;
+
+        while (size > 0)
         {
-            datagram = tx.datagram_pool.acquire();
+            if (!datagram)
+            {
+                datagram = tx.datagram_pool.acquire();
+            }
+
+            size_t s = std::min(size, m_payload_offset + m_data_size - datagram->data.size());
+            size_t offset = datagram->data.size();
+            datagram->data.resize(offset + s);
+            memcpy(datagram->data.data() + offset, data, s);
+            data += s;
+            size -= s;
+
+            if (datagram->data.size() >= m_payload_offset + m_data_size)
+            {
+                queue_tx_datagram(tx, block);
+            }
         }
+    }
 
-        size_t s = std::min(size, m_transport_datagram_size - datagram->data.size());
-        size_t offset = datagram->data.size();
-        datagram->data.resize(offset + s);
-        memcpy(datagram->data.data() + offset, data, s);
-        data += s;
-        size -= s;
+    return true;
+}
 
-        if (datagram->data.size() >= m_transport_datagram_size)
+////////////////////////////////////////////////////////////////////////////////////////////
+
+bool Fec_Encoder::flush_tx_packet(bool block)
+{
+    if (m_exit || !m_impl || !m_is_tx)
+    {
+        return false;
+    }
+
+    TX& tx = m_impl->tx;
+    if (tx.crt_datagram && tx.crt_datagram->data.size() > m_payload_offset)
+    {
+        tx.crt_datagram->data.resize(m_payload_offset + m_data_size, 0);
+        queue_tx_datagram(tx, block);
+    }
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+void Fec_Encoder::queue_tx_datagram(TX& tx, bool block)
+{
+    TX::Datagram_ptr& datagram = tx.crt_datagram;
+    if (m_tx_descriptor.is_synchronous)
+    {
+        //code it right here, the same as the TX thread would
+        TX::Block& b = tx.blocks[tx.crt_block];
+        b.datagrams.push_back(datagram);
+        process_tx_block(tx, b.datagrams.size() - 1);
+        tx.last_datagram_tp = Clock::now();
+    }
+    else
+    {
+        datagram->sequence_number = tx.next_queued_sequence_number++;
+        tx.datagram_queue.push_back(datagram, block);
+    }
+    datagram = tx.datagram_pool.acquire();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+bool Fec_Encoder::process()
+{
+    if (m_exit || !m_impl || !get_descriptor().is_synchronous)
+    {
+        return false;
+    }
+
+    if (m_is_tx)
+    {
+        TX& tx = m_impl->tx;
+        if (!tx.pending_fec_datagrams.empty() && Clock::now() - tx.last_datagram_tp >= m_tx_descriptor.fec_flush_timeout)
         {
-            tx.datagram_queue.push_back(datagram, block);
-            datagram = tx.datagram_pool.acquire();
+            //the stream stalled, don't hold back the protection of the last block any longer
+            flush_tx_fec(tx);
         }
     }
-
+    else
+    {
+        process_rx(m_impl->rx);
+    }
     return true;
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////
 
+size_t Fec_Encoder::get_dropped_tx_datagrams() const
+{
+    return m_is_tx && m_impl ? m_impl->tx.datagram_queue.get_dropped_count() : 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+Fec_Encoder::Stats Fec_Encoder::get_stats() const
+{
+    Stats stats;
+    if (!m_impl)
+    {
+        return stats;
+    }
+
+    Stats_Counters const& c = m_impl->stats;
+    stats.datagrams_received = c.datagrams_received;
+    stats.datagrams_duplicated = c.datagrams_duplicated;
+    stats.datagrams_out_of_window = c.datagrams_out_of_window;
+    stats.datagrams_rejected = c.datagrams_rejected;
+    stats.datagrams_corrupted = c.datagrams_corrupted;
+    stats.datagrams_lost = c.datagrams_lost;
+    stats.blocks_complete = c.blocks_complete;
+    stats.blocks_recovered = c.blocks_recovered;
+    stats.blocks_skipped = c.blocks_skipped;
+    stats.data_decoded = c.data_decoded;
+    std::copy(c.fec_used_histogram.begin(), c.fec_used_histogram.end(), stats.fec_used_histogram.begin());
+    std::copy(c.decode_time_histogram.begin(), c.decode_time_histogram.end(), stats.decode_time_histogram.begin());
+    std::copy(c.block_latency_histogram.begin(), c.block_latency_histogram.end(), stats.block_latency_histogram.begin());
+
+    for (size_t i = 0; i < MAX_RECEIVERS; i++)
+    {
+        stats.receivers[i].datagrams_received = c.receivers[i].datagrams_received;
+        stats.receivers[i].datagrams_duplicated = c.receivers[i].datagrams_duplicated;
+        stats.receivers[i].datagrams_used = c.receivers[i].datagrams_used;
+        stats.receivers[i].datagrams_exclusive = c.receivers[i].datagrams_exclusive;
+    }
+
+    stats.blocks_encoded = c.blocks_encoded;
+    stats.datagrams_sent = c.datagrams_sent;
+    stats.datagrams_dropped = m_is_tx ? m_impl->tx.datagram_queue.get_dropped_count() : 0;
+    stats.data_encoded = c.data_encoded;
+    return stats;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
 size_t Fec_Encoder::get_mtu() const
 {
     return m_is_tx ? m_tx_descriptor.mtu : m_rx_descriptor.mtu;
@@ -447,6 +1258,106 @@ size_t Fec_Encoder::get_mtu() const
 
 ////////////////////////////////////////////////////////////////////////////////////////////
 
+size_t Fec_Encoder::get_data_size() const
+{
+    return m_data_size;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+void Fec_Encoder::make_nonce(uint8_t* nonce, uint8_t const* salt, uint32_t block_index, uint32_t datagram_index) const
+{
+    //salt, block index, stream id and datagram index - unique per datagram as long as the salt changes between sessions
+    memcpy(nonce, salt, sizeof(uint32_t));
+    nonce[4] = block_index & 0xFF;
+    nonce[5] = (block_index >> 8) & 0xFF;
+    nonce[6] = (block_index >> 16) & 0xFF;
+    nonce[7] = get_descriptor().stream_id;
+    nonce[8] = datagram_index;
+    nonce[9] = 0;
+    nonce[10] = 0;
+    nonce[11] = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+void Fec_Encoder::encrypt_tx_datagram(uint32_t block_index, uint32_t datagram_index, std::vector<uint8_t>& data)
+{
+    //in place: the data, then the salt and the tag in the room reserved at the end
+    data.resize(m_transport_datagram_size);
+    uint8_t* payload = data.data() + m_payload_offset;
+    uint8_t* salt = payload + m_data_size;
+    uint8_t* tag = salt + sizeof(uint32_t);
+    memcpy(salt, &m_encryption_salt, sizeof(uint32_t));
+
+    std::array<uint8_t, CHACHA20_POLY1305_NONCE_SIZE> nonce;
+    make_nonce(nonce.data(), salt, block_index, datagram_index);
+    chacha20_poly1305_encrypt(m_encryption_key.data(), nonce.data(), nullptr, 0, payload, payload, m_data_size, tag);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+bool Fec_Encoder::decrypt_rx_datagram(uint32_t block_index, uint32_t datagram_index, std::vector<uint8_t> const& src, std::vector<uint8_t>& dst)
+{
+    if (src.size() != m_payload_size)
+    {
+        return false;
+    }
+    uint8_t const* salt = src.data() + m_data_size;
+    uint8_t const* tag = salt + sizeof(uint32_t);
+
+    std::array<uint8_t, CHACHA20_POLY1305_NONCE_SIZE> nonce;
+    make_nonce(nonce.data(), salt, block_index, datagram_index);
+
+    dst.resize(m_data_size);
+    return chacha20_poly1305_decrypt(m_encryption_key.data(), nonce.data(), nullptr, 0, src.data(), dst.data(), m_data_size, tag) != 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+uint16_t Fec_Encoder::generate_session_id()
+{
+    uint16_t session_id = 0;
+    while (session_id == 0)
+    {
+        session_id = static_cast<uint16_t>(std::random_device()());
+    }
+    return session_id;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+uint32_t Fec_Encoder::get_datagram_crc(Datagram_Header const& header, void const* payload, size_t payload_size)
+{
+    //the header after the crc field, then the payload. Covering the header keeps a corrupted index or coding param
+    // from putting a good payload in the wrong place
+    uint8_t const* h = reinterpret_cast<uint8_t const*>(&header) + sizeof(header.crc);
+    uint32_t crc = crc32c(0, h, sizeof(Datagram_Header) - sizeof(header.crc));
+    crc = crc32c(crc, payload, payload_size);
+    return crc != 0 ? crc : 0xFFFFFFFF;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+bool Fec_Encoder::is_datagram_intact(Datagram_Header const& header, void const* payload, size_t payload_size)
+{
+    return header.crc == 0 || header.crc == get_datagram_crc(header, payload, payload_size);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+bool Fec_Encoder::get_stream_id(void const* data, size_t size, uint8_t& stream_id)
+{
+    if (!data || size < sizeof(Datagram_Header))
+    {
+        return false;
+    }
+    stream_id = reinterpret_cast<const Datagram_Header*>(data)->stream_id;
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
 size_t Fec_Encoder::compute_mtu_from_packet_size(size_t packet_size)
 {
     if (packet_size < sizeof(Datagram_Header))
@@ -458,6 +1369,56 @@ size_t Fec_Encoder::compute_mtu_from_packet_size(size_t packet_size)
 
 ////////////////////////////////////////////////////////////////////////////////////////////
 
+void Fec_Encoder::deliver_rx_datagram(Data_ptr const& _data, uint32_t block_index, uint32_t datagram_index, uint64_t stream_offset)
+{
+    Data_ptr data = _data;
+    if (m_is_encrypted)
+    {
+        //Decrypt into a new datagram, the ciphertext might still be needed to fec decode the rest of the block.
+        //Out of place costs the same as in place so this is not an extra copy
+        RX::Datagram_ptr plain = m_impl->rx.datagram_pool.acquire();
+        if (!decrypt_rx_datagram(block_index, datagram_index, *_data, plain->data))
+        {
+            //QLOGW("Datagram {} from block {} failed authentication", datagram_index, block_index);
+            add_stat(m_impl->stats.datagrams_rejected);
+            report_rx_loss(stream_offset, m_data_size);
+            return;
+        }
+        data = Data_ptr(plain, &plain->data);
+    }
+    add_stat(m_impl->stats.data_decoded, data->size());
+
+    if (m_rx_descriptor.output_ring)
+    {
+        push_output(data);
+    }
+    else if (on_rx_data_decoded_iov)
+    {
+        RX& rx = m_impl->rx;
+        if (!rx.output_batch.empty() && (stream_offset != rx.output_batch_offset + rx.output_batch_size || rx.output_batch.size() >= IOV_MAX))
+        {
+            flush_rx_output(rx);
+        }
+        if (rx.output_batch.empty())
+        {
+            rx.output_batch_offset = stream_offset;
+        }
+        rx.output_batch.push_back(data);
+        rx.output_batch_iov.push_back({ const_cast<uint8_t*>(data->data()), data->size() });
+        rx.output_batch_size += data->size();
+    }
+    else if (on_rx_data_decoded_at)
+    {
+        on_rx_data_decoded_at(stream_offset, data->data(), data->size());
+    }
+    else if (on_rx_data_decoded)
+    {
+        on_rx_data_decoded(data->data(), data->size());
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
 static size_t s_last_seq_number = 0;
 
 void Fec_Encoder::rx_thread_proc()
@@ -467,226 +1428,460 @@ void Fec_Encoder::rx_thread_proc()
     while (!m_exit)
     {
         RX::Datagram_ptr datagram;
-        rx.datagram_queue.pop_front(datagram, true);
+
+        //with a max hold, wake up in time to give up on a stalled block even if nothing comes in. In order, when the
+        // blocks before the oldest one never showed up it's the oldest one that times out the wait, not the one after it
+        RX::Block* held = nullptr;
+        if (m_rx_descriptor.max_block_hold > Clock::duration::zero())
+        {
+            RX::Block* oldest = rx.get_oldest_block();
+            bool is_gap = oldest && !m_rx_descriptor.is_unordered && rx.is_stream_started &&
+                          get_block_index_distance(rx.next_block_index, oldest->block_index) > 0;
+            held = is_gap ? oldest : rx.get_second_oldest_block();
+        }
+        if (held)
+        {
+            Clock::duration timeout = held->first_tp + m_rx_descriptor.max_block_hold - Clock::now();
+            rx.datagram_queue.pop_front_timeout(datagram, std::max(timeout, Clock::duration::zero()));
+        }
+        else
+        {
+            rx.datagram_queue.pop_front(datagram, true);
+        }
         if (datagram)
         {
-            uint32_t block_index = datagram->block_index;
-            uint32_t datagram_index = datagram->datagram_index;
-            if (datagram_index >= m_coding_n)
-            {
-//                printf("datagram index out of range: %d > %d\n", datagram_index, m_coding_n);
-                continue;
-            }
-            if (block_index < rx.next_block_index)
-            {
-                //printf("Old datagram: %d < %d\n", block_index, rx.next_block_index.load());
-                continue;
-            }
+            process_rx_datagram(rx, datagram);
+        }
+        process_rx(rx);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+void Fec_Encoder::process_rx_datagram(RX& rx, RX::Datagram_ptr const& datagram)
+{
+    Stats_Counters& stats = m_impl->stats;
+    Stats_Counters::Receiver& receiver_stats = stats.receivers[datagram->receiver];
+    add_stat(stats.datagrams_received);
+    add_stat(receiver_stats.datagrams_received);
+
+    //before the datagram goes in, or the reset would throw it away with the stale blocks
+    expire_rx_session(rx);
+
+    uint32_t block_index = datagram->block_index;
+    uint32_t datagram_index = datagram->datagram_index;
+    if (datagram_index >= datagram->coding_n)
+    {
+//        printf("datagram index out of range: %d > %d\n", datagram_index, datagram->coding_n);
+        add_stat(stats.datagrams_rejected);
+        return;
+    }
+    if (datagram->session_id != rx.session_id)
+    {
+        if (datagram->session_id == 0 || datagram->session_id == rx.previous_session_id)
+        {
+            add_stat(stats.datagrams_out_of_window);
+            return;
+        }
+
+        //a live session is only left for a new one that looks real: a few datagrams in a row or the current one went silent
+        if (datagram->session_id != rx.candidate_session_id)
+        {
+            rx.candidate_session_id = datagram->session_id;
+            rx.candidate_datagrams = 0;
+        }
+        rx.candidate_datagrams++;
+        bool is_silent = Clock::now() - rx.last_session_datagram_tp >= m_rx_descriptor.session_timeout;
+        if (rx.session_id != 0 && !is_silent && rx.candidate_datagrams < SESSION_SWITCH_DATAGRAMS)
+        {
+            add_stat(stats.datagrams_rejected);
+            return;
+        }
+
+//        printf("New session %d\n", datagram->session_id);
+        //the transmitter restarted, its block indices start over so whatever is left in the window is stale.
+        //Start half a window back so the blocks that were reordered ahead of this one are still accepted
+        start_rx_session(rx, datagram->session_id);
+        rx.next_block_index = (block_index - RX::WINDOW_SIZE / 2) & BLOCK_INDEX_MASK;
+    }
+    rx.candidate_datagrams = 0;
+    rx.last_session_datagram_tp = Clock::now();
+
+    if (get_block_index_distance(rx.next_block_index, block_index) < 0 ||
+            (!rx.is_stream_started && rx.is_stream_anchored && get_block_index_distance(rx.stream_anchor_block_index, block_index) < 0))
+    {
+        //printf("Old datagram: %d < %d\n", block_index, rx.next_block_index);
+        add_stat(stats.datagrams_out_of_window);
+        rx.add_late_datagram(block_index, datagram_index, datagram->receiver);
+        return;
+    }
+
+    //the window has to move forward to make room for the block. Whatever falls out of it is
+    // delivered if it can be, skipped otherwise
+    if (get_block_index_distance(rx.next_block_index, block_index) >= int32_t(RX::WINDOW_SIZE))
+    {
+        uint32_t window_start = (block_index - RX::WINDOW_SIZE + 1) & BLOCK_INDEX_MASK;
+        process_rx_blocks(rx, window_start);
+        if (get_block_index_distance(rx.next_block_index, window_start) > 0)
+        {
+            rx.next_block_index = window_start;
+        }
+    }
+
+    //find the block
+    RX::Block* block = rx.find_block(block_index);
+    if (!block)
+    {
+        block = &rx.add_block(block_index, datagram->coding_k, datagram->coding_n);
+    }
 
-            RX::Block_ptr block;
+    //all the datagrams of a block have to agree on the coding params
+    if (block->coding_k != datagram->coding_k || block->coding_n != datagram->coding_n)
+    {
+//        printf("Mismatched coding params for datagram %d from block %d\n", datagram_index, block_index);
+        add_stat(stats.datagrams_rejected);
+        return;
+    }
 
-            //find the block
+    //store datagram
+    uint32_t bit = 1u << datagram_index;
+    uint8_t receiver_bit = 1u << datagram->receiver;
+    if (block->received_mask & bit)
+    {
+//        printf("Duplicated datagram %d from block %d (index %d)\n", datagram_index, block_index, block_index * block->coding_k + datagram_index);
+        if (block->receiver_masks[datagram_index] & receiver_bit)
+        {
+            add_stat(stats.datagrams_duplicated);
+        }
+        else
+        {
+            //the same datagram through another receiver. Until it's used, keep the copy with the better signal,
+            // it's less likely to have bit errors that the header checks don't catch
+            block->receiver_masks[datagram_index] |= receiver_bit;
+            add_stat(receiver_stats.datagrams_duplicated);
+            if (!(block->processed_mask & bit) && datagram->rssi > block->datagrams[datagram_index]->rssi)
             {
-                auto iter = std::lower_bound(rx.block_queue.begin(), rx.block_queue.end(), block_index, [](RX::Block_ptr const& l, uint32_t index) { return l->block_index < index; });
-                if (iter != rx.block_queue.end() && (*iter)->block_index == block_index)
-                {
-                    block = *iter;
-                }
-                else
-                {
-                    block = rx.block_pool.acquire();
-                    block->block_index = block_index;
-                    rx.block_queue.insert(iter, block);
-                }
+                block->datagrams[datagram_index] = datagram;
             }
+        }
+        return;
+    }
+    block->datagrams[datagram_index] = datagram;
+    block->received_mask |= bit;
+    block->receiver_masks[datagram_index] = receiver_bit;
+
+    //unordered, a primary doesn't wait for anything
+    if (m_rx_descriptor.is_unordered && datagram_index < block->coding_k)
+    {
+        deliver_rx_primary(rx, block_index, datagram_index);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
 
-            //store datagram
-            if (datagram->datagram_index >= m_coding_k)
+void Fec_Encoder::process_rx(RX& rx)
+{
+    expire_rx_session(rx);
+    process_rx_blocks(rx, rx.next_block_index);
+    flush_rx_output(rx);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+void Fec_Encoder::expire_rx_session(RX& rx)
+{
+    if (Clock::now() - rx.last_datagram_tp > m_rx_descriptor.reset_duration)
+    {
+//        printf("Reset block index\n");
+        //nothing usable for a while, whatever is left in the window is stale. The next datagram starts a session
+        // even if it has the same session id as before
+        start_rx_session(rx, 0);
+        rx.previous_session_id = 0;
+        rx.last_datagram_tp = Clock::now();
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+uint64_t Fec_Encoder::get_rx_block_offset(RX& rx, uint32_t block_index)
+{
+    RX::Block& block = *rx.find_block(block_index);
+    if (block.is_offset_known)
+    {
+        return block.stream_offset;
+    }
+
+    //After the last retired block (or the session's anchor, see is_stream_anchored), plus the blocks in
+    // between. Those in the window have their coding params, the missing ones most likely have this block's.
+    //Nothing on the wire tells otherwise, so after a K change with whole blocks lost the offset is a guess
+    //In order, the block is the oldest one so only the missing ones count
+    uint32_t first_index = rx.next_stream_block_index;
+    if (!rx.is_stream_started)
+    {
+        if (!rx.is_stream_anchored)
+        {
+            rx.stream_anchor_block_index = rx.get_oldest_block()->block_index;
+            rx.is_stream_anchored = true;
+        }
+        first_index = rx.stream_anchor_block_index;
+    }
+    int32_t count = std::max(get_block_index_distance(first_index, block_index), 0);
+    uint64_t offset = rx.stream_offset + uint64_t(count) * block.coding_k * m_data_size;
+    for (uint64_t mask = rx.used_mask; mask != 0; mask &= mask - 1)
+    {
+        RX::Block const& b = rx.blocks[__builtin_ctzll(mask)];
+        if (get_block_index_distance(first_index, b.block_index) >= 0 && get_block_index_distance(b.block_index, block_index) > 0)
+        {
+            offset += (int64_t(b.coding_k) - block.coding_k) * int64_t(m_data_size);
+        }
+    }
+
+    block.stream_offset = offset;
+    block.is_offset_known = true;
+    return offset;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+void Fec_Encoder::report_rx_loss(uint64_t stream_offset, size_t size)
+{
+    flush_rx_output(m_impl->rx);
+
+    //an empty datagram marks the spot in the output, in order with the data around it
+    static const Data_ptr s_loss_marker = std::make_shared<const std::vector<uint8_t>>();
+    if (m_rx_descriptor.output_ring && m_rx_descriptor.loss_markers)
+    {
+        push_output(s_loss_marker);
+    }
+
+    if (on_rx_data_lost)
+    {
+        on_rx_data_lost(stream_offset, size);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+void Fec_Encoder::report_rx_gap_loss(RX& rx, uint32_t block_index)
+{
+    //the blocks before this one that never showed up
+    uint64_t offset = get_rx_block_offset(rx, block_index);
+    if (offset > rx.stream_offset)
+    {
+        report_rx_loss(rx.stream_offset, offset - rx.stream_offset);
+        rx.stream_offset = offset;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+void Fec_Encoder::finish_rx_block(RX& rx, uint32_t block_index)
+{
+    report_rx_gap_loss(rx, block_index);
+
+    //the primaries never delivered, in runs. In order they are the tail of the block
+    RX::Block const& block = *rx.find_block(block_index);
+    uint32_t lost_mask = ~block.processed_mask & ((1u << block.coding_k) - 1);
+    while (lost_mask != 0)
+    {
+        size_t first = __builtin_ctz(lost_mask);
+        size_t count = __builtin_ctz(~(lost_mask >> first));
+        report_rx_loss(block.stream_offset + first * m_data_size, count * m_data_size);
+        lost_mask &= ~(((1u << count) - 1) << first);
+    }
+    rx.stream_offset = std::max(rx.stream_offset, block.stream_offset + block.coding_k * m_data_size);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+void Fec_Encoder::deliver_rx_primary(RX& rx, uint32_t block_index, uint32_t datagram_index)
+{
+    RX::Block& block = *rx.find_block(block_index);
+    uint64_t offset = get_rx_block_offset(rx, block_index) + datagram_index * m_data_size;
+    RX::Datagram_ptr const& d = block.datagrams[datagram_index];
+    deliver_rx_datagram(Data_ptr(d, &d->data), block_index, datagram_index, offset);
+    rx.last_datagram_tp = Clock::now();
+    block.processed_mask |= 1u << datagram_index;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+void Fec_Encoder::flush_rx_output(RX& rx)
+{
+    if (rx.output_batch.empty())
+    {
+        return;
+    }
+    on_rx_data_decoded_iov(rx.output_batch_offset, rx.output_batch_iov.data(), rx.output_batch_iov.size());
+    rx.output_batch.clear();
+    rx.output_batch_iov.clear();
+    rx.output_batch_size = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+void Fec_Encoder::start_rx_session(RX& rx, uint16_t session_id)
+{
+    while (RX::Block* block = rx.get_oldest_block())
+    {
+        add_skipped_block_stats(m_impl->stats, *block);
+        finish_rx_block(rx, block->block_index);
+        rx.retire_block(*block, m_impl->stats);
+    }
+    for (RX::Retired_Block& retired: rx.retired_blocks)
+    {
+        rx.count_exclusive(retired, m_impl->stats); //the copies from the old session are rejected from now on
+    }
+    rx.is_stream_started = false; //the blocks of the new session don't follow the old ones
+    rx.is_stream_anchored = false;
+    rx.previous_session_id = rx.session_id;
+    rx.session_id = session_id;
+    rx.next_block_index = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+void Fec_Encoder::process_rx_blocks(RX& rx, uint32_t window_start)
+{
+    //delivers the primaries in order, stopping at the first missing one. Unordered, all the ones that are in
+    auto deliver_primaries = [this, &rx](RX::Block& block)
+    {
+        for (size_t i = 0; i < block.coding_k; i++)
+        {
+            uint32_t bit = 1u << i;
+            if (!(block.received_mask & bit))
             {
-                auto iter = std::lower_bound(block->fec_datagrams.begin(), block->fec_datagrams.end(), datagram_index, [](RX::Datagram_ptr const& l, uint32_t index) { return l->datagram_index < index; });
-                if (iter != block->fec_datagrams.end() && (*iter)->datagram_index == datagram_index)
+                if (m_rx_descriptor.is_unordered)
                 {
-//                    printf("Duplicated datagram %d from block %d (index %d)\n", datagram_index, block_index, block_index * m_coding_k + datagram_index);
                     continue;
                 }
-                else
-                {
-                    block->fec_datagrams.insert(iter, datagram);
-                }
+                break;
             }
-            else
+            if (!(block.processed_mask & bit))
             {
-                auto iter = std::lower_bound(block->datagrams.begin(), block->datagrams.end(), datagram_index, [](RX::Datagram_ptr const& l, uint32_t index) { return l->datagram_index < index; });
-                if (iter != block->datagrams.end() && (*iter)->datagram_index == datagram_index)
-                {
-//                    printf("Duplicated datagram %d from block %d (index %d)\n", datagram_index, block_index, block_index * m_coding_k + datagram_index);
-                    continue;
-                }
-                else
+                if (block.processed_mask == 0 && !m_rx_descriptor.is_unordered)
                 {
-                    block->datagrams.insert(iter, datagram);
+                    //the blocks before this one that never showed up go first, their late datagrams would come out of order
+                    report_rx_gap_loss(rx, block.block_index);
+                    rx.next_block_index = block.block_index;
                 }
+
+//                uint32_t seq_number = block.block_index * block.coding_k + i;
+//                if (s_last_seq_number + 1 != seq_number)
+//                    printf("Datagram %d: %s\n", seq_number, s_last_seq_number + 1 == seq_number ? "Ok" : "Skipped");
+//                s_last_seq_number = seq_number;
+
+                deliver_rx_primary(rx, block.block_index, i);
             }
         }
+    };
 
+    size_t max_blocks = m_rx_descriptor.max_blocks > 0 ? m_rx_descriptor.max_blocks : 2 * m_rx_descriptor.interleaving_depth + 1;
+    Stats_Counters& stats = m_impl->stats;
 
-        if (Clock::now() - rx.last_datagram_tp > m_rx_descriptor.reset_duration)
-        {
-//            printf("Reset block index\n");
-            rx.next_block_index = 0;
-        }
+    //skip if too much buffering, if it's been held too long or if the block fell out of the window. With interleaving,
+    // interleaving_depth blocks are in flight at the same time and when the TX spreads the fec datagrams, they overlap
+    // with the next group of blocks
+    auto should_skip = [this, &rx, max_blocks, window_start](uint32_t block_index, Clock::time_point newer_first_tp)
+    {
+        bool is_expired = m_rx_descriptor.max_block_hold > Clock::duration::zero() && Clock::now() - newer_first_tp >= m_rx_descriptor.max_block_hold;
+        return rx.get_block_count() > max_blocks || is_expired || get_block_index_distance(window_start, block_index) < 0;
+    };
 
-        while (!rx.block_queue.empty())
-        {
-            RX::Block_ptr block = rx.block_queue.front();
+    while (RX::Block* oldest = rx.get_oldest_block())
+    {
+        RX::Block& block = *oldest;
+        uint32_t primary_mask = (1u << block.coding_k) - 1;
 
-            //entire block received
-            if (block->datagrams.size() >= m_coding_k)
+        //In order, the blocks before the oldest one can still come in (their first datagrams were lost or reordered,
+        // common with interleaving). It waits for them the same way it waits for its own missing datagrams
+        if (!m_rx_descriptor.is_unordered && rx.is_stream_started && get_block_index_distance(rx.next_block_index, block.block_index) > 0)
+        {
+            if (!should_skip(rx.next_block_index, block.first_tp))
             {
-                //printf("Complete block\n");
-                for (RX::Datagram_ptr const& d: block->datagrams)
-                {
-                    uint32_t seq_number = block->block_index * m_coding_k + d->datagram_index;
-                    if (!d->is_processed)
-                    {
-//                        if (s_last_seq_number + 1 != seq_number)
-//                            printf("Datagram C %d: %s\n", seq_number, s_last_seq_number + 1 == seq_number ? "Ok" : "Skipped");
-//                        s_last_seq_number = seq_number;
-
-                        m_video_stats_data_accumulated += d->data.size();
-                        if (on_rx_data_decoded)
-                        {
-                            on_rx_data_decoded(d->data.data(), d->data.size());
-                        }
-                        rx.last_datagram_tp = Clock::now();
-                        d->is_processed = true;
-                    }
-                }
+                break;
+            }
+            report_rx_gap_loss(rx, block.block_index);
+            rx.next_block_index = block.block_index;
+        }
 
-                rx.last_block_tp = Clock::now();
+        //try to process consecutive datagrams before the block is finished to minimize latency
+        deliver_primaries(block);
 
-                rx.next_block_index = block->block_index + 1;
-                rx.block_queue.pop_front();
-                continue;
-            }
+        //entire block received
+        if ((block.received_mask & primary_mask) == primary_mask)
+        {
+            //printf("Complete block\n");
+            rx.last_block_tp = Clock::now();
+            add_stat(stats.blocks_complete);
+            add_histogram_stat(stats.block_latency_histogram.data(), rx.last_block_tp - block.first_tp);
+            finish_rx_block(rx, block.block_index);
+            rx.retire_block(block, stats);
+            continue;
+        }
 
-            //try to process consecutive datagrams before the block is finished to minimize latency
-            for (size_t i = 0; i < block->datagrams.size(); i++)
+        //can we fec decode?
+        if (size_t(__builtin_popcount(block.received_mask)) >= block.coding_k)
+        {
+            //printf("Complete FEC block\n");
+            Clock::time_point start = Clock::now();
+
+            std::array<unsigned int, MAX_CODING_K> indices;
+            size_t fec_index = block.coding_k;
+            size_t missing_count = 0;
+            for (size_t i = 0; i < block.coding_k; i++)
             {
-                RX::Datagram_ptr const& d = block->datagrams[i];
-                if (d->datagram_index == i)
+                if (block.received_mask & (1u << i))
                 {
-                    uint32_t seq_number = block->block_index * m_coding_k + d->datagram_index;
-                    if (!d->is_processed)
-                    {
-//                        if (s_last_seq_number + 1 != seq_number)
-//                            printf("Datagram E %d: %s\n", seq_number, s_last_seq_number + 1 == seq_number ? "Ok" : "Skipped");
-//                        s_last_seq_number = seq_number;
-
-                        m_video_stats_data_accumulated += d->data.size();
-                        if (on_rx_data_decoded)
-                        {
-                            on_rx_data_decoded(d->data.data(), d->data.size());
-                        }
-                        rx.last_datagram_tp = Clock::now();
-                        d->is_processed = true;
-                    }
+                    m_fec_src_datagram_ptrs[i] = block.datagrams[i]->data.data();
+                    indices[i] = i;
                 }
                 else
                 {
-                    break;
-                }
-            }
-
-            //can we fec decode?
-            if (block->datagrams.size() + block->fec_datagrams.size() >= m_coding_k)
-            {
-                //printf("Complete FEC block\n");
-                //auto start = Clock::now();
-
-                std::array<unsigned int, 32> indices;
-                size_t primary_index = 0;
-                size_t used_fec_index = 0;
-                for (size_t i = 0; i < m_coding_k; i++)
-                {
-                    if (primary_index < block->datagrams.size() && i == block->datagrams[primary_index]->datagram_index)
+                    //use the next received fec datagram in place of the missing primary
+                    while (!(block.received_mask & (1u << fec_index)))
                     {
-                        m_fec_src_datagram_ptrs[i] = block->datagrams[primary_index]->data.data();
-                        indices[i] = block->datagrams[primary_index]->datagram_index;
-                        primary_index++;
+                        fec_index++;
                     }
-                    else
-                    {
-                        m_fec_src_datagram_ptrs[i] = block->fec_datagrams[used_fec_index]->data.data();
-                        indices[i] = block->fec_datagrams[used_fec_index]->datagram_index;
-                        used_fec_index++;
-                    }
-                }
+                    m_fec_src_datagram_ptrs[i] = block.datagrams[fec_index]->data.data();
+                    indices[i] = fec_index;
+                    fec_index++;
 
-                //insert the missing datagrams, they will be filled with data by the fec_decode below
-                size_t fec_index = 0;
-                for (size_t i = 0; i < m_coding_k; i++)
-                {
-                    if (i >= block->datagrams.size() || i != block->datagrams[i]->datagram_index)
-                    {
-                        block->datagrams.insert(block->datagrams.begin() + i, rx.datagram_pool.acquire());
-                        block->datagrams[i]->data.resize(m_payload_size);
-                        block->datagrams[i]->datagram_index = i;
-                        m_fec_dst_datagram_ptrs[fec_index++] = block->datagrams[i]->data.data();
-                    }
+                    //the missing primary is rebuilt straight into its slot
+                    block.datagrams[i] = rx.datagram_pool.acquire();
+                    m_fec_dst_datagram_ptrs[missing_count++] = block.datagrams[i]->data.data();
                 }
+            }
 
-                fec_decode(m_fec, m_fec_src_datagram_ptrs.data(), m_fec_dst_datagram_ptrs.data(), indices.data(), m_payload_size);
+            fec_decode(get_fec(block.coding_k, block.coding_n), m_fec_src_datagram_ptrs.data(), m_fec_dst_datagram_ptrs.data(), indices.data(), m_payload_size);
+            block.received_mask |= primary_mask;
+            add_histogram_stat(stats.decode_time_histogram.data(), Clock::now() - start);
 
-                //now dispatch them
-                for (size_t i = 0; i < block->datagrams.size(); i++)
-                {
-                    RX::Datagram_ptr const& d = block->datagrams[i];
-                    uint32_t seq_number = block->block_index * m_coding_k + d->datagram_index;
-                    if (!d->is_processed)
-                    {
-//                        if (s_last_seq_number + 1 != seq_number)
-//                            printf("Datagram F %d: %s\n", seq_number, s_last_seq_number + 1 == seq_number ? "Ok" : "Skipped");
-//                        s_last_seq_number = seq_number;
-
-                        m_video_stats_data_accumulated += d->data.size();
-                        if (on_rx_data_decoded)
-                        {
-                            on_rx_data_decoded(d->data.data(), d->data.size());
-                        }
-                        rx.last_datagram_tp = Clock::now();
-                        d->is_processed = true;
-                    }
-                }
+            //now dispatch them
+            deliver_primaries(block);
 
-                //QLOGI("Decoded fac: {}", Clock::now() - start);
+            //QLOGI("Decoded fac: {}", Clock::now() - start);
 
-                rx.last_block_tp = Clock::now();
-                rx.next_block_index = block->block_index + 1;
-                rx.block_queue.pop_front();
-                continue;
-            }
-
-            //skip if too much buffering
-            if (rx.block_queue.size() > 3)
-            {
-                //printf("Skipping block\n");
-                for (size_t i = 0; i < block->datagrams.size(); i++)
-                {
-                    RX::Datagram_ptr const& d = block->datagrams[i];
-                    if (!d->is_processed)
-                    {
-                        uint32_t seq_number = block->block_index * m_coding_k + d->datagram_index;
-//                        printf("Skipping %d\n", seq_number);
-                    }
-                }
-                rx.next_block_index = block->block_index + 1;
-                rx.block_queue.pop_front();
-                continue;
-            }
+            rx.last_block_tp = Clock::now();
+            add_stat(stats.blocks_recovered);
+            add_stat(stats.fec_used_histogram[missing_count]);
+            add_histogram_stat(stats.block_latency_histogram.data(), rx.last_block_tp - block.first_tp);
+            finish_rx_block(rx, block.block_index);
+            rx.retire_block(block, stats);
+            continue;
+        }
 
-            break;
+        RX::Block* newer = rx.get_second_oldest_block();
+        if (should_skip(block.block_index, newer ? newer->first_tp : Clock::now()))
+        {
+            //printf("Skipping block\n");
+            add_skipped_block_stats(stats, block);
+            finish_rx_block(rx, block.block_index);
+            rx.retire_block(block, stats);
+            continue;
         }
+
+        break;
     }
 }
 
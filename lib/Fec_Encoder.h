@@ -1,10 +1,16 @@
 #pragma once
 
 #include <vector>
+#include <array>
 #include <string>
 #include <atomic>
 #include <thread>
+#include <memory>
+#include <chrono>
+#include <functional>
+#include <sys/uio.h>
 #include "Queue.h"
+#include "Spsc_Ring.h"
 
 struct fec_t;
 
@@ -19,24 +25,129 @@ public:
 
     static const uint8_t MAX_CODING_K = 16;
     static const uint8_t MAX_CODING_N = 32;
-    static const size_t PAYLOAD_OVERHEAD = 6;
+    static const size_t MAX_INTERLEAVING_DEPTH = 16;
+    static const size_t PAYLOAD_OVERHEAD = 15;
+    static const size_t ENCRYPTION_KEY_SIZE = 32;
+    static const size_t ENCRYPTION_OVERHEAD = 4 + 16; //nonce salt + tag at the end of every primary datagram
+    static const size_t MAX_RECEIVERS = 8;
+
+    //The header isn't authenticated so a datagram from another session can be corrupted or spoofed. While the current
+    // session is alive, the RX switches only after this many datagrams of the new one with none of the current one in between
+    static const size_t SESSION_SWITCH_DATAGRAMS = 4;
+
+    //Handle to an encoded or decoded datagram. It keeps the pooled buffer alive until it's released
+    typedef std::shared_ptr<const std::vector<uint8_t>> Data_ptr;
+    typedef Spsc_Ring<Data_ptr, 256> Output_Ring;
+
+#pragma pack(push, 1)
+
+    //The wire format, in front of every datagram. Shared with Static_Fec_Encoder
+    struct Datagram_Header
+    {
+        uint32_t crc; //CRC32C of the rest of the header and the payload, 0 if the TX doesn't checksum
+        uint32_t block_index : 24;
+        uint32_t datagram_index : 8;
+        uint16_t size : 16;
+        uint8_t coding_k; //the coding params travel with every datagram so they can change between blocks
+        uint8_t coding_n;
+        uint8_t stream_id;
+        uint16_t session_id; //random per TX session, never 0. A new one tells the RX the transmitter restarted
+    };
+
+#pragma pack(pop)
+
+    //The block index is 24 bits on the wire and wraps around so the indices are compared with serial number
+    // arithmetic (RFC 1982): how many blocks to is ahead of from, negative if it's behind
+    static const uint32_t BLOCK_INDEX_MASK = 0xFFFFFF;
+    static int32_t get_block_index_distance(uint32_t from, uint32_t to)
+    {
+        return static_cast<int32_t>(((to - from) & BLOCK_INDEX_MASK) << 8) >> 8;
+    }
+
+    //a random, non zero session id for a new TX
+    static uint16_t generate_session_id();
+
+    //The crc for the header, never 0 (a CRC32C of 0 is sent as 0xFFFFFFFF like in UDP) so 0 can mean unchecked.
+    //is_datagram_intact is true for unchecked datagrams as well
+    static uint32_t get_datagram_crc(Datagram_Header const& header, void const* payload, size_t payload_size);
+    static bool is_datagram_intact(Datagram_Header const& header, void const* payload, size_t payload_size);
 
     struct Descriptor
     {
+        //On RX the coding params of every block come from the datagram headers,
+        // these are only used to size the buffers
         uint8_t coding_k = 12;
         uint8_t coding_n = 20;
+        uint8_t stream_id = 0; //RX ignores datagrams from other streams
         size_t mtu = 1376;
-        size_t max_enqueued_packets = 100;
+        size_t max_enqueued_packets = 100; //at most 1024 on RX
+
+        //If set, the encoded (TX) or decoded (RX) datagrams are pushed here instead of calling on_tx_data_encoded/on_rx_data_decoded
+        // and the consumer drains them on its own thread, so slow IO doesn't stall the coding.
+        //When the ring is full the coding thread waits for room. Has to outlive the encoder.
+        Output_Ring* output_ring = nullptr;
+
+        //ENCRYPTION_KEY_SIZE bytes to encrypt and authenticate the primary datagrams with ChaCha20-Poly1305, empty for no encryption.
+        //Both ends have to use the same key. Each datagram then carries ENCRYPTION_OVERHEAD bytes less data
+        std::vector<uint8_t> encryption_key;
+
+        //No thread: add_tx_packet/add_rx_packet do the coding on the caller's thread and the callbacks are called from them.
+        //Saves two context switches per datagram on single core boards. Call process() periodically for the timeouts
+        bool is_synchronous = false;
+
+        //Number of consecutive blocks whose datagrams are sent round-robin.
+        //A burst loss of L datagrams then costs each block only ~L/depth of them, at the cost
+        // of holding depth blocks on the TX side before sending. Both ends have to use the same value.
+        size_t interleaving_depth = 1;
     };
 
     struct TX_Descriptor : public Descriptor
     {
+        //0 sends the fec datagrams of a block right after its primaries.
+        //Otherwise they are held back and one goes out after every fec_spread primaries of the next block.
+        //This smooths the TX rate and decorrelates the loss of the fec datagrams from the loss of the primaries.
+        size_t fec_spread = 0;
+
+        //if no new data comes in for this long, the held back fec datagrams are sent anyway
+        Clock::duration fec_flush_timeout = std::chrono::milliseconds(20);
+
+        //Every datagram carries a CRC32C of itself and the RX drops the ones that don't match before they
+        // enter the window, so a corrupted datagram can't spread into a whole block through the fec decoding.
+        //Hardware crc instructions where available, ~0.2us per 1400 byte datagram. The RX always checks, no need to configure it
+        bool is_checksummed = false;
+
+        //Latest wins: when max_enqueued_packets datagrams are waiting to be coded, the oldest coding_k of them are
+        // dropped to make room instead of add_tx_packet blocking or dropping the new data. The blocks the dropped
+        // datagrams fall in are given up on, the receiver reports them lost instead of getting the stream spliced.
+        //For live streams, it keeps the latency bounded when the link can't keep up
+        bool drop_oldest = false;
     };
 
     struct RX_Descriptor : public Descriptor
     {
         //Clock::duration max_latency = std::chrono::milliseconds(500);
         Clock::duration reset_duration = std::chrono::milliseconds(1000);
+
+        //A datagram from another session switches to it right away only if the current session has been silent this long,
+        // otherwise it takes a few of them in a row. A single corrupted or spoofed header can't cut off the link
+        Clock::duration session_timeout = std::chrono::milliseconds(100);
+
+        //An incomplete block is given up on once the block after it has been waiting this long, so the output
+        // latency is bounded in time whatever the stream rate. Zero waits only for max_blocks
+        Clock::duration max_block_hold = Clock::duration::zero();
+
+        //An incomplete block is also given up on when more than this many blocks are in flight.
+        //0 is 2 * interleaving_depth + 1, enough for interleaving and fec spreading
+        size_t max_blocks = 0;
+
+        //Every primary is delivered as soon as it arrives instead of waiting for the ones before it, the recovered ones
+        // follow when the block is decoded. For consumers that don't need the order (samples with their own timestamps,
+        // idempotent updates), it cuts the latency of everything after a loss. Use on_rx_data_decoded_at to get the offsets
+        bool is_unordered = false;
+
+        //With an output_ring, an empty datagram is pushed into it wherever data was lost, so its consumer
+        // sees the loss in order with the data. on_rx_data_lost is called either way
+        bool loss_markers = false;
     };
 
     bool init_tx(TX_Descriptor const& descriptor);
@@ -44,60 +155,201 @@ public:
 
     Descriptor const& get_descriptor() const;
 
-    //add the received, encoded packets here
-    bool add_rx_packet(void const* data, size_t size, bool block);
+    //TX only. Changes the coding params starting with the next block (or group of interleaved blocks).
+    //The receiver follows automatically as the params are sent with every datagram.
+    bool set_coding_params(uint8_t coding_k, uint8_t coding_n);
+    static bool are_coding_params_valid(uint8_t coding_k, uint8_t coding_n);
+
+    //Add the received, encoded packets here.
+    //Always from the same thread (same for add_rx_buffer), the packets are handed to the RX thread through a lock free SPSC queue.
+    //Diversity: the packets of up to MAX_RECEIVERS receivers (Phys) of the same stream can go into the same decoder, the
+    // receiver index tells them apart. A datagram missed by one receiver is filled in by another and the copies
+    // are deduplicated, keeping the one with the best rssi
+    bool add_rx_packet(void const* data, size_t size, bool block, size_t receiver = 0, int rssi = 0);
+
+    //Zero copy alternative to add_rx_packet: a pooled datagram lent to the receiver so the packet
+    // is received straight into it (see Phy::receive_data with iovecs) and queued without copying
+    struct RX_Buffer
+    {
+        std::array<iovec, 2> iov; //the header and the payload, in wire order
+        std::shared_ptr<void> datagram;
+
+        //where it was received, see add_rx_packet
+        size_t receiver = 0;
+        int rssi = 0;
+    };
+    bool acquire_rx_buffer(RX_Buffer& buffer);
+
+    //queues a buffer filled with a received packet of size bytes. The buffer is consumed, even if the packet is dropped
+    bool add_rx_buffer(RX_Buffer& buffer, size_t size, bool block);
 
-    //async, the decoded packets will be ready here
+    //async (sync when is_synchronous), the decoded packets will be ready here
     std::function<void(void const* data, size_t size)> on_rx_data_decoded;
 
+    //Called instead of on_rx_data_decoded if set, with where the data goes in the stream. Needed with is_unordered.
+    //The offsets are exact only while the coding_k doesn't change: the blocks that never arrived carry no coding
+    // params, they are sized with the coding_k of the block after them. Across a set_coding_params that changes K
+    // with whole blocks lost, the offsets after the loss can be off by the difference
+    std::function<void(uint64_t stream_offset, void const* data, size_t size)> on_rx_data_decoded_at;
+
+    //Called instead of both if set: the datagrams that follow each other in the stream and are ready at the same time
+    // (a decoded block, the consecutive primaries unblocked by a late one) come in one call, for a single writev.
+    //The iovecs are valid only during the call
+    std::function<void(uint64_t stream_offset, iovec const* iov, size_t count)> on_rx_data_decoded_iov;
+
+    //Same thread as on_rx_data_decoded and in order with it, called as soon as some data is known to be lost: the
+    // undelivered primaries of a block given up on, a datagram that failed authentication or whole blocks that never
+    // arrived (sized as the block after them, see on_rx_data_decoded_at for when K changes). Lost datagrams count as full ones. stream_offset counts all the data, delivered or lost, so the
+    // downstream decoder knows exactly what's missing and can conceal it or ask for a key frame right away.
+    //With is_unordered the missing blocks are reported when the block after them is done with, they could still show up before that
+    std::function<void(uint64_t stream_offset, size_t size)> on_rx_data_lost;
+
     //add un-encoded packets to be sent here
     bool add_tx_packet(void const* data, size_t size, bool block);
 
-    //async, encoded packets will be ready here
+    //same as above but gathers the packet from several buffers (header + payload for example) straight into the datagrams
+    bool add_tx_packet(iovec const* iov, size_t count, bool block);
+
+    //The data only goes out a whole datagram at a time. This pads the partial one with zeros and sends it now.
+    //The zeros are part of the decoded stream, only for data the reader can skip them in (like the Compressor frames)
+    bool flush_tx_packet(bool block);
+
+    //async (sync when is_synchronous), encoded packets will be ready here
     std::function<void(void const* data, size_t size)> on_tx_data_encoded;
 
+    //Synchronous mode only, call it every few ms. Handles the timeouts when no data comes in:
+    // the fec_flush_timeout on TX, the max_block_hold and the reset_duration on RX
+    bool process();
+
+    //TX only. Datagrams dropped from the queue with drop_oldest
+    size_t get_dropped_tx_datagrams() const;
+
+    static const size_t HISTOGRAM_SIZE = 20;
+
+    //Counters since init, to size K and N and to spot regressions
+    struct Stats
+    {
+        //RX
+        size_t datagrams_received = 0;
+        size_t datagrams_duplicated = 0; //received twice by the same receiver. Copies from other receivers are in receivers
+        size_t datagrams_out_of_window = 0; //for blocks already done with (like the unneeded fec datagrams of complete blocks) or from the previous session
+        size_t datagrams_rejected = 0; //inconsistent headers or failed authentication
+        size_t datagrams_corrupted = 0; //crc mismatch
+        size_t datagrams_lost = 0; //primaries of the skipped blocks that were never delivered
+        size_t blocks_complete = 0; //all the primaries received
+        size_t blocks_recovered = 0; //the missing primaries were rebuilt from the fec datagrams
+        size_t blocks_skipped = 0; //given up on, with some of the data lost
+        size_t data_decoded = 0; //bytes
+
+        //the recovered blocks by how many fec datagrams they consumed
+        std::array<size_t, MAX_CODING_K + 1> fec_used_histogram = {};
+
+        //Log2 buckets of microseconds: bucket i counts the durations in [2^i, 2^(i+1)) us. The first one also
+        // has everything under 1 us and the last one everything longer
+        std::array<size_t, HISTOGRAM_SIZE> decode_time_histogram = {}; //fec decoding a block
+        std::array<size_t, HISTOGRAM_SIZE> block_latency_histogram = {}; //from the first datagram of a block until it's done with
+
+        //RX, per receiver
+        struct Receiver
+        {
+            size_t datagrams_received = 0;
+            size_t datagrams_duplicated = 0; //another receiver had it first
+            size_t datagrams_used = 0; //its copy was the one kept (first or best rssi)
+            size_t datagrams_exclusive = 0; //no other receiver had it, lost without this one. Counted a window of blocks late
+        };
+        std::array<Receiver, MAX_RECEIVERS> receivers;
+
+        //TX
+        size_t blocks_encoded = 0;
+        size_t datagrams_sent = 0; //primaries and fec
+        size_t datagrams_dropped = 0; //drop_oldest
+        size_t data_encoded = 0; //bytes
+    };
+
+    //A snapshot of the counters. Lock free, can be called from any thread while the encoder runs
+    Stats get_stats() const;
+
     size_t get_mtu() const;
+
+    //how much data fits in a datagram: the mtu minus the encryption overhead, if any
+    size_t get_data_size() const;
     static size_t compute_mtu_from_packet_size(size_t packet_size);
 
+    //reads the stream id of an encoded datagram, used to demultiplex several streams
+    static bool get_stream_id(void const* data, size_t size, uint8_t& stream_id);
+
     struct RX;
     struct TX;
+    struct RX_Datagram;
 
 private:
 
     bool init();
 
     void tx_thread_proc();
+    void process_tx_block(TX& tx, size_t start);
+    void start_tx_blocks(TX& tx);
+    void restart_tx_block(TX& tx);
+    void update_tx_coding_params(TX& tx);
+    uint32_t get_next_tx_block_index(TX& tx);
+    size_t skip_tx_gaps(TX& tx, size_t start);
+    void queue_tx_datagram(TX& tx, bool block);
     void rx_thread_proc();
+    void process_rx_datagram(RX& rx, std::shared_ptr<RX_Datagram> const& datagram);
+    void process_rx(RX& rx);
+    void expire_rx_session(RX& rx);
+    bool is_rx_header_valid(Datagram_Header const& header, size_t size) const;
+    void start_rx_session(RX& rx, uint16_t session_id);
+    uint64_t get_rx_block_offset(RX& rx, uint32_t block_index);
+    void report_rx_loss(uint64_t stream_offset, size_t size);
+    void report_rx_gap_loss(RX& rx, uint32_t block_index);
+    void finish_rx_block(RX& rx, uint32_t block_index);
+    void deliver_rx_primary(RX& rx, uint32_t block_index, uint32_t datagram_index);
+    void flush_rx_output(RX& rx);
+    void process_rx_blocks(RX& rx, uint32_t window_start);
+
+    void encode_tx_block(TX& tx, size_t block_idx);
+    void send_tx_blocks(TX& tx);
+    void send_tx_primary(TX& tx, Data_ptr const& data);
+    void send_tx_datagram(Data_ptr const& data);
+    void deliver_rx_datagram(Data_ptr const& data, uint32_t block_index, uint32_t datagram_index, uint64_t stream_offset);
+    void push_output(Data_ptr const& data);
+    void flush_tx_fec(TX& tx);
 
     bool m_is_tx = false;
+    uint16_t m_session_id = 0;
 
     TX_Descriptor m_tx_descriptor;
     RX_Descriptor m_rx_descriptor;
 
     uint8_t m_coding_k = 1;
     uint8_t m_coding_n = 2;
+    std::atomic<uint16_t> m_pending_coding_params = { 0 }; //k << 8 | n, 0 if nothing pending
 
     struct Impl;
     std::unique_ptr<Impl> m_impl;
     bool m_exit = false;
     std::thread m_thread;
 
-    fec_t* m_fec = nullptr;
+    void make_nonce(uint8_t* nonce, uint8_t const* salt, uint32_t block_index, uint32_t datagram_index) const;
+    void encrypt_tx_datagram(uint32_t block_index, uint32_t datagram_index, std::vector<uint8_t>& data);
+    bool decrypt_rx_datagram(uint32_t block_index, uint32_t datagram_index, std::vector<uint8_t> const& src, std::vector<uint8_t>& dst);
+
+    bool m_is_encrypted = false;
+    std::array<uint8_t, ENCRYPTION_KEY_SIZE> m_encryption_key = {};
+    uint32_t m_encryption_salt = 0; //random per session (and block index wrap) so the nonces are never reused
+
+    fec_t* get_fec(uint8_t coding_k, uint8_t coding_n);
+    std::array<fec_t*, MAX_CODING_K * MAX_CODING_N> m_fecs = {};
     std::array<uint8_t const*, MAX_CODING_K> m_fec_src_datagram_ptrs;
     std::array<uint8_t*, MAX_CODING_N> m_fec_dst_datagram_ptrs;
 
     size_t m_transport_datagram_size = 0;
     size_t m_streaming_datagram_size = 0;
     size_t m_payload_size = 0;
+    size_t m_data_size = 0; //m_payload_size minus the encryption overhead
 
     size_t m_datagram_header_offset = 0;
     size_t m_payload_offset = 0;
-
-    std::atomic_int m_best_input_dBm = { 0 };
-    std::atomic_int m_latched_input_dBm = { 0 };
-
-    size_t m_video_stats_rate = 0;
-    size_t m_video_stats_data_accumulated = 0;
-    Clock::time_point m_video_stats_last_tp = Clock::now();
 };
 
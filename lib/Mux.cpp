@@ -0,0 +1,239 @@
+#include "Mux.h"
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+Mux::Mux()
+{
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+Mux::~Mux()
+{
+    //stop the encoders while the rings are still alive
+    m_tx_groups.clear();
+    m_tx_streams.clear();
+    m_rx_streams.clear();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+void* Mux::TX_Stream::operator new(size_t size)
+{
+    void* ptr = nullptr;
+    if (posix_memalign(&ptr, alignof(TX_Stream), size) != 0)
+    {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+void Mux::TX_Stream::operator delete(void* ptr)
+{
+    free(ptr);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+bool Mux::init(Descriptor const& descriptor)
+{
+    if (m_is_initialized)
+    {
+        return false;
+    }
+
+    for (TX_Stream_Descriptor const& d: descriptor.tx_streams)
+    {
+        if (m_tx_stream_map[d.fec.stream_id])
+        {
+            //QLOGE("Duplicated TX stream {}", d.fec.stream_id);
+            return false;
+        }
+
+        std::unique_ptr<TX_Stream> stream(new TX_Stream);
+        stream->descriptor = d;
+
+        //the encoder pushes straight into the stream's ring, pop_tx_datagram takes the datagrams from there
+        Fec_Encoder::TX_Descriptor fec = d.fec;
+        fec.output_ring = &stream->ring;
+        if (!stream->encoder.init_tx(fec))
+        {
+            return false;
+        }
+
+        TX_Stream* s = stream.get();
+        m_tx_stream_map[d.fec.stream_id] = s;
+        m_tx_streams.push_back(std::move(stream));
+
+        auto it = std::find_if(m_tx_groups.begin(), m_tx_groups.end(), [&d](TX_Group const& g) { return g.priority <= d.priority; });
+        if (it == m_tx_groups.end() || it->priority != d.priority)
+        {
+            it = m_tx_groups.insert(it, TX_Group());
+            it->priority = d.priority;
+        }
+        it->streams.push_back(s);
+    }
+
+    for (Fec_Encoder::RX_Descriptor const& d: descriptor.rx_streams)
+    {
+        if (m_rx_stream_map[d.stream_id])
+        {
+            //QLOGE("Duplicated RX stream {}", d.stream_id);
+            return false;
+        }
+
+        std::unique_ptr<RX_Stream> stream(new RX_Stream);
+        stream->descriptor = d;
+
+        uint8_t stream_id = d.stream_id;
+        stream->encoder.on_rx_data_decoded = [this, stream_id](void const* data, size_t size)
+        {
+            if (on_rx_data_decoded)
+            {
+                on_rx_data_decoded(stream_id, data, size);
+            }
+        };
+        if (on_rx_data_lost)
+        {
+            stream->encoder.on_rx_data_lost = [this, stream_id](uint64_t stream_offset, size_t size)
+            {
+                on_rx_data_lost(stream_id, stream_offset, size);
+            };
+        }
+
+        if (!stream->encoder.init_rx(d))
+        {
+            return false;
+        }
+
+        m_rx_stream_map[d.stream_id] = stream.get();
+        m_rx_streams.push_back(std::move(stream));
+    }
+
+    m_is_initialized = true;
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+bool Mux::add_tx_packet(uint8_t stream_id, void const* data, size_t size, bool block)
+{
+    TX_Stream* stream = m_tx_stream_map[stream_id];
+    if (!stream)
+    {
+        return false;
+    }
+    return stream->encoder.add_tx_packet(data, size, block);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+bool Mux::add_tx_packet(uint8_t stream_id, iovec const* iov, size_t count, bool block)
+{
+    TX_Stream* stream = m_tx_stream_map[stream_id];
+    if (!stream)
+    {
+        return false;
+    }
+    return stream->encoder.add_tx_packet(iov, count, block);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+bool Mux::pop_tx_datagram(Fec_Encoder::Data_ptr& data)
+{
+    //The highest priority stream with something to send. Within a priority the search starts after the last
+    // served stream so they take turns
+    for (TX_Group& group: m_tx_groups)
+    {
+        size_t count = group.streams.size();
+        for (size_t i = 0; i < count; i++)
+        {
+            size_t index = (group.crt_stream + i) % count;
+            if (group.streams[index]->ring.try_pop(data))
+            {
+                group.crt_stream = (index + 1) % count;
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+bool Mux::add_rx_packet(void const* data, size_t size, bool block, size_t receiver, int rssi)
+{
+    uint8_t stream_id = 0;
+    if (!Fec_Encoder::get_stream_id(data, size, stream_id))
+    {
+        return false;
+    }
+
+    RX_Stream* stream = m_rx_stream_map[stream_id];
+    if (!stream)
+    {
+        return true; //not interested in this stream
+    }
+    return stream->encoder.add_rx_packet(data, size, block, receiver, rssi);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+bool Mux::acquire_rx_buffer(Fec_Encoder::RX_Buffer& buffer)
+{
+    return !m_rx_streams.empty() && m_rx_streams.front()->encoder.acquire_rx_buffer(buffer);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+bool Mux::add_rx_buffer(Fec_Encoder::RX_Buffer& buffer, size_t size, bool block)
+{
+    uint8_t stream_id = 0;
+    if (m_rx_streams.empty() || !Fec_Encoder::get_stream_id(buffer.iov[0].iov_base, buffer.iov[0].iov_len, stream_id))
+    {
+        buffer.datagram.reset();
+        return false;
+    }
+
+    RX_Stream* owner = m_rx_streams.front().get();
+    if (stream_id == owner->descriptor.stream_id)
+    {
+        return owner->encoder.add_rx_buffer(buffer, size, block);
+    }
+
+    //another stream's packet, its decoder has its own buffers
+    m_rx_copy.clear();
+    for (iovec const& iov: buffer.iov)
+    {
+        size_t s = std::min(iov.iov_len, size - m_rx_copy.size());
+        uint8_t const* ptr = reinterpret_cast<uint8_t const*>(iov.iov_base);
+        m_rx_copy.insert(m_rx_copy.end(), ptr, ptr + s);
+    }
+    buffer.datagram.reset();
+    return add_rx_packet(m_rx_copy.data(), m_rx_copy.size(), block, buffer.receiver, buffer.rssi);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+Fec_Encoder* Mux::get_tx_stream(uint8_t stream_id)
+{
+    TX_Stream* stream = m_tx_stream_map[stream_id];
+    return stream ? &stream->encoder : nullptr;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+Fec_Encoder* Mux::get_rx_stream(uint8_t stream_id)
+{
+    RX_Stream* stream = m_rx_stream_map[stream_id];
+    return stream ? &stream->encoder : nullptr;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <vector>
+#include <array>
+#include <memory>
+#include <functional>
+#include "Fec_Encoder.h"
+
+//Multiplexes several streams, each with its own Fec_Encoder, over one link.
+//TX: every stream's encoder pushes its datagrams into its own ring and pop_tx_datagram takes them out by priority -
+// a datagram from a higher priority stream is always sent before any datagram of a lower priority one. Streams with
+// the same priority are served round-robin. The datagrams aren't copied, they stay in their encoder's pool until sent.
+//RX: datagrams are routed to their stream's decoder based on the stream id in the datagram header.
+//
+//Note that a Fec_Encoder sends a datagram only when it's full, so streams with small messages (control, telemetry)
+// should use a small mtu and Fec_Encoder::flush_tx_packet.
+class Mux
+{
+public:
+    Mux();
+    ~Mux();
+
+    struct TX_Stream_Descriptor
+    {
+        Fec_Encoder::TX_Descriptor fec; //fec.stream_id identifies the stream. fec.output_ring is set by the Mux
+        uint8_t priority = 0; //higher is sent first
+    };
+
+    struct Descriptor
+    {
+        std::vector<TX_Stream_Descriptor> tx_streams;
+        std::vector<Fec_Encoder::RX_Descriptor> rx_streams; //rx_streams[i].stream_id identifies the stream
+    };
+
+    //the callbacks have to be set before this
+    bool init(Descriptor const& descriptor);
+
+    //add un-encoded packets to be sent on a stream
+    bool add_tx_packet(uint8_t stream_id, void const* data, size_t size, bool block);
+    bool add_tx_packet(uint8_t stream_id, iovec const* iov, size_t count, bool block);
+
+    //The next datagram to send, in priority order. false if none of the streams has one ready.
+    //Always from the same thread, the one that feeds Phy::send_data
+    bool pop_tx_datagram(Fec_Encoder::Data_ptr& data);
+
+    //add the received, encoded packets here. Always from the same thread
+    bool add_rx_packet(void const* data, size_t size, bool block, size_t receiver = 0, int rssi = 0);
+
+    //Zero copy alternative to add_rx_packet, see Fec_Encoder::acquire_rx_buffer. The buffers come from the decoder of
+    // the first RX stream so it should be the one with the most traffic and the biggest mtu. The (small) packets of
+    // the other streams are copied into theirs
+    bool acquire_rx_buffer(Fec_Encoder::RX_Buffer& buffer);
+    bool add_rx_buffer(Fec_Encoder::RX_Buffer& buffer, size_t size, bool block);
+
+    //async, called from the decoding thread of each stream without an output_ring
+    std::function<void(uint8_t stream_id, void const* data, size_t size)> on_rx_data_decoded;
+
+    //async, see Fec_Encoder::on_rx_data_lost
+    std::function<void(uint8_t stream_id, uint64_t stream_offset, size_t size)> on_rx_data_lost;
+
+    Fec_Encoder* get_tx_stream(uint8_t stream_id);
+    Fec_Encoder* get_rx_stream(uint8_t stream_id);
+
+private:
+    struct TX_Stream
+    {
+        TX_Stream_Descriptor descriptor;
+        Fec_Encoder::Output_Ring ring; //before the encoder so it outlives it
+        Fec_Encoder encoder;
+
+        //the ring is cache line aligned and a C++11 new only guarantees the alignment of the fundamental types
+        static void* operator new(size_t size);
+        static void operator delete(void* ptr);
+    };
+
+    //the streams with the same priority
+    struct TX_Group
+    {
+        uint8_t priority = 0;
+        std::vector<TX_Stream*> streams;
+        size_t crt_stream = 0; //the next one to serve first, for round-robin
+    };
+
+    struct RX_Stream
+    {
+        Fec_Encoder::RX_Descriptor descriptor;
+        Fec_Encoder encoder;
+    };
+
+    bool m_is_initialized = false;
+
+    std::vector<std::unique_ptr<TX_Stream>> m_tx_streams;
+    std::vector<TX_Group> m_tx_groups; //by decreasing priority
+    std::vector<std::unique_ptr<RX_Stream>> m_rx_streams;
+    std::array<TX_Stream*, 256> m_tx_stream_map = {};
+    std::array<RX_Stream*, 256> m_rx_stream_map = {};
+    std::vector<uint8_t> m_rx_copy; //for the packets of the other streams received in an RX buffer
+};
@@ -0,0 +1,161 @@
+#include "Pacer.h"
+#include <thread>
+#include <algorithm>
+#include <cmath>
+
+const size_t Pacer::FIRMWARE_QUEUE_SIZE;
+const size_t Pacer::FIRMWARE_PACKET_OVERHEAD;
+
+struct Rate_Info
+{
+    float mbps;
+    bool is_ofdm;
+    bool is_short_preamble;
+};
+
+//same order as Phy::Rate
+static const Rate_Info s_rate_infos[] =
+{
+    { 1.f, false, false },
+    { 2.f, false, false },
+    { 2.f, false, true },
+    { 5.5f, false, false },
+    { 5.5f, false, true },
+    { 11.f, false, false },
+    { 11.f, false, true },
+    { 6.f, true, false },
+    { 9.f, true, false },
+    { 12.f, true, false },
+    { 18.f, true, false },
+    { 24.f, true, false },
+    { 36.f, true, false },
+    { 48.f, true, false },
+    { 54.f, true, false },
+};
+static_assert(sizeof(s_rate_infos) / sizeof(Rate_Info) == size_t(Phy::Rate::COUNT), "Check the rate infos");
+
+//////////////////////////////////////////////////////////////////////////////
+
+Pacer::Pacer()
+{
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+bool Pacer::init(Descriptor const& descriptor)
+{
+    if (descriptor.rate >= Phy::Rate::COUNT || descriptor.queue_size <= FIRMWARE_PACKET_OVERHEAD + Phy::MAX_PAYLOAD_SIZE)
+    {
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lg(m_mutex);
+    m_descriptor = descriptor;
+    m_last_tp = Clock::now();
+    m_tokens = Clock::duration::zero();
+    m_depth = Clock::duration::zero();
+    apply_rate(descriptor.rate);
+    m_tokens = m_depth; //the firmware queue starts empty
+    return true;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+bool Pacer::set_rate(Phy::Rate rate)
+{
+    if (rate >= Phy::Rate::COUNT)
+    {
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lg(m_mutex);
+    apply_rate(rate);
+    return true;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+void Pacer::apply_rate(Phy::Rate rate)
+{
+    m_descriptor.rate = rate;
+
+    //the bucket holds the airtime of as many full packets as fit in the firmware queue
+    size_t max_packets = m_descriptor.queue_size / (Phy::MAX_PAYLOAD_SIZE + FIRMWARE_PACKET_OVERHEAD);
+    m_depth = compute_airtime(rate, Phy::MAX_PAYLOAD_SIZE) * max_packets;
+    m_tokens = std::min(m_tokens, m_depth);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+Pacer::Clock::duration Pacer::compute_airtime(Phy::Rate rate, size_t size)
+{
+    Rate_Info const& info = s_rate_infos[static_cast<size_t>(rate)];
+
+    //what goes on air: 802.11 header + crc + payload + FCS
+    size_t bytes = size + FIRMWARE_PACKET_OVERHEAD - 4 + 4;
+
+    float us = 0.f;
+    if (info.is_ofdm)
+    {
+        //preamble + signal, 4us symbols carrying service + tail + data, signal extension. Then DIFS + average backoff (CWmin 15, 9us slots)
+        float bits_per_symbol = info.mbps * 4.f;
+        us = 20.f + 4.f * std::ceil((16.f + 6.f + 8.f * bytes) / bits_per_symbol) + 6.f;
+        us += 28.f + 7.5f * 9.f;
+    }
+    else
+    {
+        //PLCP preamble + header. Then DIFS + average backoff (CWmin 31, 20us slots)
+        us = (info.is_short_preamble ? 96.f : 192.f) + 8.f * bytes / info.mbps;
+        us += 50.f + 15.5f * 20.f;
+    }
+
+    return std::chrono::duration_cast<Clock::duration>(std::chrono::duration<float, std::micro>(us));
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+void Pacer::refill()
+{
+    Clock::time_point now = Clock::now();
+    m_tokens = std::min(m_tokens + (now - m_last_tp), m_depth);
+    m_last_tp = now;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+bool Pacer::try_consume(size_t size)
+{
+    std::lock_guard<std::mutex> lg(m_mutex);
+
+    refill();
+    Clock::duration cost = compute_airtime(m_descriptor.rate, size);
+    if (m_tokens < cost)
+    {
+        return false;
+    }
+    m_tokens -= cost;
+    return true;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+void Pacer::wait(size_t size)
+{
+    std::unique_lock<std::mutex> lg(m_mutex);
+
+    refill();
+    Clock::duration cost = compute_airtime(m_descriptor.rate, size);
+    if (m_tokens < cost)
+    {
+        Clock::duration duration = cost - m_tokens;
+        lg.unlock();
+        std::this_thread::sleep_for(duration);
+        lg.lock();
+        refill();
+    }
+
+    //the sleep can be a bit short, the debt is paid by the next packet
+    m_tokens -= cost;
+}
+
+//////////////////////////////////////////////////////////////////////////////
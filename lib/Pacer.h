@@ -0,0 +1,53 @@
+#pragma once
+
+#include <chrono>
+#include <mutex>
+#include "Phy.h"
+
+//Paces the packets sent to the esp8266 so its send queue never overflows.
+//The firmware queue (S2W_BUFFER_SIZE in firmware/structures.h) holds only ~9 full packets and drops
+// anything that doesn't fit, so instead of pushing packets as fast as the SPI allows this
+// meters them with a token bucket of airtime: every packet costs the time it takes to go on air at
+// the current rate and the bucket holds as much airtime as fits in the firmware queue.
+class Pacer
+{
+public:
+    Pacer();
+
+    typedef std::chrono::high_resolution_clock Clock;
+
+    //mirror the firmware
+    static const size_t FIRMWARE_QUEUE_SIZE = Phy::FIRMWARE_QUEUE_SIZE;
+    static const size_t FIRMWARE_PACKET_OVERHEAD = Phy::FIRMWARE_PACKET_OVERHEAD;
+
+    struct Descriptor
+    {
+        Phy::Rate rate = Phy::Rate::RATE_B_5_5M_CCK;
+        size_t queue_size = FIRMWARE_QUEUE_SIZE;
+    };
+
+    bool init(Descriptor const& descriptor);
+
+    //call this when the PHY rate changes
+    bool set_rate(Phy::Rate rate);
+
+    //blocks until the packet can be sent without overflowing the firmware queue and takes its tokens
+    void wait(size_t size);
+
+    //takes the tokens if there are enough and returns true, otherwise returns false
+    bool try_consume(size_t size);
+
+    //estimated time a packet of size bytes takes on air, including the preamble and the average channel access time
+    static Clock::duration compute_airtime(Phy::Rate rate, size_t size);
+
+private:
+    void refill();
+    void apply_rate(Phy::Rate rate);
+
+    std::mutex m_mutex;
+    Descriptor m_descriptor;
+    Clock::duration m_depth = Clock::duration::zero();
+    Clock::duration m_tokens = Clock::duration::zero();
+    Clock::time_point m_last_tp = Clock::now();
+};
+
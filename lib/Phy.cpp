@@ -24,12 +24,16 @@ enum SPI_Command : uint16_t
     SPI_CMD_SET_POWER = 7,
     SPI_CMD_GET_POWER = 8,
     SPI_CMD_GET_STATS = 9,
+    SPI_CMD_GET_TX_CREDITS = 10,
 };
 
 const size_t Phy::MAX_PAYLOAD_SIZE;
+const size_t Phy::FIRMWARE_QUEUE_SIZE;
+const size_t Phy::FIRMWARE_PACKET_OVERHEAD;
 static const size_t MAX_PACKET_SIZE = Phy::MAX_PAYLOAD_SIZE + 2; //crc
 
 static const uint32_t COMMAND_DELAY_US = 5000;
+static const uint32_t TX_CREDITS_POLL_US = 100;
 
 
 static const uint16_t s_crc_table[256] =
@@ -358,16 +362,29 @@ bool Phy::send_data(void const* data, size_t size)
         }
     }
 
+    size_t cost = compute_tx_cost(size);
+    m_tx_credits = m_tx_credits > cost ? m_tx_credits - cost : 0;
+
     return true;
 }
 
 //////////////////////////////////////////////////////////////////////////////
 
 bool Phy::receive_data(void* data, size_t& size, int& rssi)
+{
+    iovec iov;
+    iov.iov_base = data;
+    iov.iov_len = MAX_PAYLOAD_SIZE;
+    return receive_data(&iov, 1, size, rssi);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+bool Phy::receive_data(iovec const* iov, size_t count, size_t& size, int& rssi)
 {
     std::lock_guard<std::mutex> lg(m_mutex);
 
-    assert(data);
+    assert(iov && count > 0);
     size = 0;
     rssi = 0;
 
@@ -378,6 +395,11 @@ bool Phy::receive_data(void* data, size_t& size, int& rssi)
     }
 
     uint32_t status = get_status();
+    if ((status >> 24) == SPI_Command::SPI_CMD_GET_TX_CREDITS)
+    {
+        set_tx_credits(status); //no packet, the firmware reports its free send space instead
+        return false;
+    }
     if ((status >> 24) != SPI_Command::SPI_CMD_GET_PACKET)
     {
         return false;
@@ -392,6 +414,14 @@ bool Phy::receive_data(void* data, size_t& size, int& rssi)
         return false;
     }
 
+    //the packet is scattered over the buffers, what doesn't fit is read anyway and dropped
+    size_t capacity = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        capacity += iov[i].iov_len;
+    }
+    bool fits = size - 2 <= capacity;
+
     uint32_t crc = 0;
 
     uint8_t tx[CHUNK_SIZE + 2];
@@ -399,38 +429,63 @@ bool Phy::receive_data(void* data, size_t& size, int& rssi)
     tx[0] = 0x3;
     tx[1] = 0x0;
 
-    uint8_t* data_ptr = reinterpret_cast<uint8_t*>(data);
+    size -= 2; //the first 2 bytes are the crc, only the rest is data
+
+    size_t iov_index = 0;
+    size_t iov_offset = 0;
     size_t left = size;
-    while (left > 0)
+    bool is_first_chunk = true;
+    while (is_first_chunk || left > 0)
     {
         size_t chunk_size = std::min(CHUNK_SIZE, left);
         if (!transfer(tx, rx, CHUNK_SIZE + 2)) //always do complete transactions
         {
+            size = 0;
             return false;
         }
 
         uint8_t const* src_ptr = rx + 2; //these 2 bytes are the spi commands
-        if (left == size) //consume the crc first
+        if (is_first_chunk) //consume the crc first
         {
             memcpy(&crc, src_ptr, 2);
             src_ptr += 2;
             chunk_size = std::min(CHUNK_SIZE - 2, left);
+            is_first_chunk = false;
         }
-        memcpy(data_ptr, src_ptr, chunk_size);
         left -= chunk_size;
-        data_ptr += chunk_size;
+
+        //straight into the caller's buffers
+        while (fits && chunk_size > 0 && iov_index < count)
+        {
+            size_t s = std::min(chunk_size, iov[iov_index].iov_len - iov_offset);
+            memcpy(reinterpret_cast<uint8_t*>(iov[iov_index].iov_base) + iov_offset, src_ptr, s);
+            src_ptr += s;
+            chunk_size -= s;
+            iov_offset += s;
+            if (iov_offset >= iov[iov_index].iov_len)
+            {
+                iov_index++;
+                iov_offset = 0;
+            }
+        }
     }
 
-    size -= 2; //ythe first 2 bytes are the crc
+    if (!fits)
+    {
+        size = 0;
+        return false;
+    }
 
-    //the first 2 bytes are the crc
-    uint16_t computed_crc = crc16(0, data, size);
+    uint16_t computed_crc = 0;
+    left = size;
+    for (size_t i = 0; i < count && left > 0; i++)
+    {
+        size_t s = std::min(left, iov[i].iov_len);
+        computed_crc = crc16(computed_crc, iov[i].iov_base, s);
+        left -= s;
+    }
     if (crc != computed_crc)
     {
-//        for (size_t i = 0; i < size; i++)
-//        {
-//            printf("%02X,", ((uint8_t const*)data)[i]);
-//        }
         //std::cout << "CRC for size " << std::to_string(size) << " is " << std::to_string(crc) << " \n";
         size = 0;
         return false;
@@ -442,6 +497,87 @@ bool Phy::receive_data(void* data, size_t& size, int& rssi)
 
 //////////////////////////////////////////////////////////////////////////////
 
+size_t Phy::compute_tx_cost(size_t size)
+{
+    return size + FIRMWARE_PACKET_OVERHEAD;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+size_t Phy::compute_tx_credits(size_t free_size)
+{
+    size_t slack = compute_tx_cost(MAX_PAYLOAD_SIZE);
+    return free_size > slack ? free_size - slack : 0;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+void Phy::set_tx_credits(uint32_t status)
+{
+    m_has_tx_credits = true;
+    m_tx_credits = compute_tx_credits(status & 0xFFFF);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+bool Phy::get_tx_credits(size_t& credits)
+{
+    std::lock_guard<std::mutex> lg(m_mutex);
+
+    credits = m_tx_credits;
+    return m_has_tx_credits;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+bool Phy::update_tx_credits()
+{
+    std::lock_guard<std::mutex> lg(m_mutex);
+
+    uint32_t command = (SPI_Command::SPI_CMD_GET_TX_CREDITS << 24);
+    if (!send_command(command))
+    {
+        return false;
+    }
+
+    //the firmware answers from the SPI interrupt, no need to wait
+    uint32_t status = get_status();
+    if ((status >> 24) != SPI_Command::SPI_CMD_GET_TX_CREDITS)
+    {
+        return false;
+    }
+    set_tx_credits(status);
+    return true;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+bool Phy::wait_for_tx_credits(size_t size, Clock::duration timeout)
+{
+    size_t cost = compute_tx_cost(size);
+    Clock::time_point start_tp = Clock::now();
+    while (true)
+    {
+        {
+            std::lock_guard<std::mutex> lg(m_mutex);
+            if (!m_has_tx_credits || m_tx_credits >= cost)
+            {
+                return true;
+            }
+        }
+        if (Clock::now() - start_tp >= timeout)
+        {
+            return false;
+        }
+
+        //the queue drains at the PHY rate, give it some time before asking again
+        gpioDelay(TX_CREDITS_POLL_US);
+        update_tx_credits();
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
 bool Phy::set_rate(Rate rate)
 {
     std::lock_guard<std::mutex> lg(m_mutex);
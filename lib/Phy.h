@@ -5,6 +5,8 @@
 #include <vector>
 #include <array>
 #include <mutex>
+#include <chrono>
+#include <sys/uio.h>
 #include <linux/spi/spidev.h>
 
 class Phy
@@ -12,6 +14,8 @@ class Phy
 public:
     Phy();
 
+    typedef std::chrono::high_resolution_clock Clock;
+
     enum class Init_Result
     {
         OK,
@@ -27,9 +31,37 @@ public:
 
     static const size_t MAX_PAYLOAD_SIZE = 1374;
 
+    //mirror the firmware send queue (S2W_BUFFER_SIZE in firmware/structures.h)
+    static const size_t FIRMWARE_QUEUE_SIZE = 13000;
+    static const size_t FIRMWARE_PACKET_OVERHEAD = 4 + 24 + 2; //queue size prefix, 802.11 header, crc
+
     bool send_data(void const* data, size_t size);
     bool receive_data(void* data, size_t& size, int& rssi);
 
+    //same as above but scatters the packet over several buffers, so it can land straight where it's needed
+    // (Fec_Encoder::acquire_rx_buffer for example). Packets bigger than the buffers are dropped
+    bool receive_data(iovec const* iov, size_t count, size_t& size, int& rssi);
+
+    //TX credits are the bytes that can still be sent without the firmware dropping them.
+    //The firmware reports the free space of its send queue when asked (update_tx_credits) and whenever
+    // receive_data finds no packet, and every send_data takes the cost of its packet until the next report.
+    //Returns false if the firmware never reported any (older firmware)
+    bool get_tx_credits(size_t& credits);
+
+    //asks the firmware for the free space of its send queue
+    bool update_tx_credits();
+
+    //blocks until a packet of size bytes fits in the firmware queue. Returns false if it still doesn't after timeout.
+    //If the firmware doesn't report credits it returns true right away - there's no way to know
+    bool wait_for_tx_credits(size_t size, Clock::duration timeout);
+
+    //what a packet of size bytes takes from the firmware queue
+    static size_t compute_tx_cost(size_t size);
+
+    //the credits for a reported free space. The queue keeps every packet contiguous so up to
+    // one packet worth of space can be wasted where it wraps
+    static size_t compute_tx_credits(size_t free_size);
+
     enum class Rate
     {
       RATE_B_1M_CCK,
@@ -78,9 +110,13 @@ private:
     uint32_t get_status();
     bool send_command(uint32_t command);
     bool get_data();
+    void set_tx_credits(uint32_t status);
 
     std::mutex m_mutex;
 
+    bool m_has_tx_credits = false;
+    size_t m_tx_credits = 0;
+
     size_t m_speed = 0;
     size_t m_comms_delay = 0;
 
@@ -12,57 +12,60 @@
 template<class T> struct Pool
 {
     std::function<void(T&)> on_acquire;
-    std::function<void(T&)> on_release;
+    std::function<void(T&)> on_release; //called with the pool locked, and not at all for the items returned after the pool is gone
 
     typedef std::shared_ptr<T> Ptr;
     Pool();
+    ~Pool();
     Ptr acquire();
 
 private:
-    std::function<void(T*)> m_garbage_collector;
-    std::mutex m_mutex;
-    std::vector<std::unique_ptr<T>> m_items;
+    //The items can outlive the pool (queued in an output ring for example) so they hold the free list weakly.
+    //Once the pool is gone they are deleted instead of returned
+    struct Free_List
+    {
+        std::mutex mutex;
+        Pool* pool = nullptr;
+        std::vector<std::unique_ptr<T>> items;
+        int x_returned = 0;
+    };
+    std::shared_ptr<Free_List> m_free_list;
 
     int x_reused = 0;
     int x_new = 0;
-    int x_returned = 0;
 };
 
 
 template<class T> Pool<T>::Pool()
+    : m_free_list(std::make_shared<Free_List>())
 {
-    m_garbage_collector = [this](T* t)
-    {
-        x_returned++;
-        if (on_release)
-        {
-            on_release(*t);
-        }
+    m_free_list->pool = this;
+}
 
-        std::lock_guard<std::mutex> lg(m_mutex);
-        m_items.emplace_back(static_cast<T*>(t)); //will create a unique pointer from the raw one
-//        printf("%d// new:%d reused:%d returned:%d\n", this, x_new, x_reused, x_returned);
-    };
+template<class T> Pool<T>::~Pool()
+{
+    std::lock_guard<std::mutex> lg(m_free_list->mutex);
+    m_free_list->pool = nullptr;
 }
 
 template<class T> auto Pool<T>::acquire() -> Ptr
 {
-    //this will be called when the last shared_ptr to T dies. We can safetly return the object to pur pool
-
-    std::lock_guard<std::mutex> lg(m_mutex);
     T* item = nullptr;
-    if (!m_items.empty())
-    {
-        x_reused++;
-        item = m_items.back().release(); //release the raw ptr from the control of the unique ptr
-        m_items.pop_back();
-//        printf("%d// new:%d reused:%d returned:%d\n", this, x_new, x_reused, x_returned);
-    }
-    else
     {
-        x_new++;
-        item = new T;
-//        printf("%d// new:%d reused:%d returned:%d\n", this, x_new, x_reused, x_returned);
+        std::lock_guard<std::mutex> lg(m_free_list->mutex);
+        if (!m_free_list->items.empty())
+        {
+            x_reused++;
+            item = m_free_list->items.back().release(); //release the raw ptr from the control of the unique ptr
+            m_free_list->items.pop_back();
+//            printf("%d// new:%d reused:%d returned:%d\n", this, x_new, x_reused, m_free_list->x_returned);
+        }
+        else
+        {
+            x_new++;
+            item = new T;
+//            printf("%d// new:%d reused:%d returned:%d\n", this, x_new, x_reused, m_free_list->x_returned);
+        }
     }
     assert(item);
 
@@ -71,5 +74,26 @@ template<class T> auto Pool<T>::acquire() -> Ptr
         on_acquire(static_cast<T&>(*item));
     }
 
-    return Ptr(item, [this](T* item) { m_garbage_collector(item); });
+    //this will be called when the last shared_ptr to T dies. We can safetly return the object to our pool
+    std::weak_ptr<Free_List> weak_free_list = m_free_list;
+    return Ptr(item, [weak_free_list](T* item)
+    {
+        std::unique_ptr<T> t(item);
+        std::shared_ptr<Free_List> free_list = weak_free_list.lock();
+        if (!free_list)
+        {
+            return;
+        }
+
+        std::lock_guard<std::mutex> lg(free_list->mutex);
+        if (free_list->pool)
+        {
+            free_list->x_returned++;
+            if (free_list->pool->on_release)
+            {
+                free_list->pool->on_release(*item);
+            }
+            free_list->items.push_back(std::move(t));
+        }
+    });
 }
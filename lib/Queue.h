@@ -1,6 +1,7 @@
 #pragma once
 
 #include <deque>
+#include <algorithm>
 #include <vector>
 #include <atomic>
 #include <mutex>
@@ -25,6 +26,13 @@ public:
     bool pop_front_timeout(T& dst, std::chrono::high_resolution_clock::duration timeout);
     bool pop_front_timeout(std::vector<T>& dst, size_t max, std::chrono::high_resolution_clock::duration timeout);
 
+    //Latest wins: when the queue is full, push_back drops the count oldest items to make room instead of
+    // blocking or refusing the new one. For live data that goes stale. 0 (the default) turns it off
+    void set_drop_oldest(size_t count);
+
+    //how many items were dropped to make room
+    size_t get_dropped_count() const;
+
 private:
     bool _push_back(T const& t, bool block, std::chrono::high_resolution_clock::duration* timeout);
     bool _pop_front(T& dst, bool block, std::chrono::high_resolution_clock::duration* timeout);
@@ -34,6 +42,8 @@ private:
     std::condition_variable m_cv;
     std::deque<T> m_queue;
     size_t m_max_size = 10;
+    size_t m_drop_oldest_count = 0;
+    std::atomic<size_t> m_dropped_count = { 0 };
     bool m_exit = false;
 };
 
@@ -60,6 +70,19 @@ void Queue<T>::exit()
     m_cv.notify_all();
 }
 
+template<class T>
+void Queue<T>::set_drop_oldest(size_t count)
+{
+    std::unique_lock<std::mutex> lg(m_mutex);
+    m_drop_oldest_count = count;
+}
+
+template<class T>
+size_t Queue<T>::get_dropped_count() const
+{
+    return m_dropped_count;
+}
+
 template<class T>
 bool Queue<T>::push_back(T const& dst, bool block)
 {
@@ -109,6 +132,12 @@ bool Queue<T>::_push_back(T const& t, bool block, std::chrono::high_resolution_c
     //send the current datagram
     {
         std::unique_lock<std::mutex> lg(m_mutex);
+        if (m_drop_oldest_count > 0 && m_queue.size() >= m_max_size)
+        {
+            size_t count = std::min(m_drop_oldest_count, m_queue.size());
+            m_queue.erase(m_queue.begin(), m_queue.begin() + count);
+            m_dropped_count += count;
+        }
         if (block)
         {
             while (m_queue.size() >= m_max_size && !m_exit)
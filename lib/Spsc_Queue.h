@@ -0,0 +1,210 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <cerrno>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include "Spsc_Ring.h"
+
+//A blocking queue for exactly one producer thread and one consumer thread, on top of a Spsc_Ring.
+//Same push_back/pop_front interface as Queue but there is no lock: the items go through the ring and a side
+// that has to wait spins for a bit, then parks on an eventfd. The other side only makes the (write) syscall when
+// it sees the waiting side parked, so while both keep up nobody enters the kernel.
+//Up to SIZE items but max_size limits it further so it can be configured at runtime.
+template<typename T, size_t SIZE> class Spsc_Queue
+{
+public:
+    Spsc_Queue(size_t max_size);
+    ~Spsc_Queue();
+
+    Spsc_Queue(Spsc_Queue const&) = delete;
+    Spsc_Queue& operator=(Spsc_Queue const&) = delete;
+
+    void exit();
+
+    //producer side
+    bool push_back(T const& t, bool block);
+
+    //consumer side
+    bool pop_front(T& dst, bool block);
+    bool pop_front_timeout(T& dst, std::chrono::high_resolution_clock::duration timeout);
+
+    //approximate when called from a third thread
+    size_t size() const;
+    static constexpr size_t capacity() { return SIZE; }
+
+private:
+    typedef std::chrono::high_resolution_clock Clock;
+
+    bool _pop_front(T& dst, bool block, Clock::duration* timeout);
+
+    //spins, then parks on fd until is_ready() or the deadline (if any)
+    template<typename F> void wait(std::atomic<bool>& parked, int fd, F is_ready, Clock::time_point const* until);
+    void wake(std::atomic<bool>& parked, int fd);
+
+    static const size_t SPIN_COUNT = 64;
+
+    Spsc_Ring<T, SIZE> m_ring;
+    size_t m_max_size = SIZE;
+
+    int m_data_fd = -1; //the producer wakes the consumer with it
+    int m_space_fd = -1; //and the consumer wakes the producer
+    alignas(64) std::atomic<bool> m_consumer_parked = { false };
+    alignas(64) std::atomic<bool> m_producer_parked = { false };
+    std::atomic<bool> m_exit = { false };
+};
+
+
+template<typename T, size_t SIZE>
+const size_t Spsc_Queue<T, SIZE>::SPIN_COUNT;
+
+template<typename T, size_t SIZE>
+Spsc_Queue<T, SIZE>::Spsc_Queue(size_t max_size)
+    : m_max_size(max_size < SIZE ? max_size : SIZE)
+{
+    m_data_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    m_space_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+}
+
+template<typename T, size_t SIZE>
+Spsc_Queue<T, SIZE>::~Spsc_Queue()
+{
+    exit();
+    if (m_data_fd >= 0)
+    {
+        close(m_data_fd);
+    }
+    if (m_space_fd >= 0)
+    {
+        close(m_space_fd);
+    }
+}
+
+template<typename T, size_t SIZE>
+void Spsc_Queue<T, SIZE>::exit()
+{
+    m_exit = true;
+    uint64_t one = 1;
+    if (m_data_fd >= 0 && write(m_data_fd, &one, sizeof(one)) < 0) {}
+    if (m_space_fd >= 0 && write(m_space_fd, &one, sizeof(one)) < 0) {}
+}
+
+template<typename T, size_t SIZE>
+size_t Spsc_Queue<T, SIZE>::size() const
+{
+    return m_ring.size();
+}
+
+template<typename T, size_t SIZE>
+bool Spsc_Queue<T, SIZE>::push_back(T const& t, bool block)
+{
+    while (!m_exit)
+    {
+        if (m_ring.size() < m_max_size && m_ring.try_push(t))
+        {
+            wake(m_consumer_parked, m_data_fd);
+            return true;
+        }
+        if (!block)
+        {
+            return false;
+        }
+        wait(m_producer_parked, m_space_fd, [this]() { return m_ring.size() < m_max_size; }, nullptr);
+    }
+    return false;
+}
+
+template<typename T, size_t SIZE>
+bool Spsc_Queue<T, SIZE>::pop_front(T& dst, bool block)
+{
+    return _pop_front(dst, block, nullptr);
+}
+
+template<typename T, size_t SIZE>
+bool Spsc_Queue<T, SIZE>::pop_front_timeout(T& dst, Clock::duration timeout)
+{
+    return _pop_front(dst, true, &timeout);
+}
+
+template<typename T, size_t SIZE>
+bool Spsc_Queue<T, SIZE>::_pop_front(T& dst, bool block, Clock::duration* timeout)
+{
+    Clock::time_point until = Clock::now();
+    if (timeout)
+    {
+        until += *timeout;
+    }
+
+    while (!m_exit)
+    {
+        if (m_ring.try_pop(dst))
+        {
+            wake(m_producer_parked, m_space_fd);
+            return true;
+        }
+        if (!block || (timeout && Clock::now() >= until))
+        {
+            return false;
+        }
+        wait(m_consumer_parked, m_data_fd, [this]() { return !m_ring.empty(); }, timeout ? &until : nullptr);
+    }
+    return false;
+}
+
+template<typename T, size_t SIZE>
+template<typename F>
+void Spsc_Queue<T, SIZE>::wait(std::atomic<bool>& parked, int fd, F is_ready, Clock::time_point const* until)
+{
+    //the other side is usually only a few microseconds behind, that's cheaper than a sleep
+    for (size_t i = 0; i < SPIN_COUNT; i++)
+    {
+        if (is_ready() || m_exit)
+        {
+            return;
+        }
+        std::this_thread::yield();
+    }
+
+    //Announce the park, then check again. Paired with the fence in wake, either the other side sees the flag
+    // or this sees its item, so a wake up is never lost
+    parked.store(true, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (!is_ready() && !m_exit)
+    {
+        timespec ts;
+        timespec* tsp = nullptr;
+        if (until)
+        {
+            Clock::duration left = std::max(*until - Clock::now(), Clock::duration::zero());
+            auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(left).count();
+            ts.tv_sec = ns / 1000000000;
+            ts.tv_nsec = ns % 1000000000;
+            tsp = &ts;
+        }
+        pollfd pfd = { fd, POLLIN, 0 };
+        if (ppoll(&pfd, 1, tsp, nullptr) < 0 && errno != EINTR)
+        {
+            //QLOGE("Cannot wait for the queue: {}", errno);
+        }
+    }
+    parked.store(false, std::memory_order_relaxed);
+
+    //clear the wake up (or a stale one), whoever comes next checks the ring first anyway
+    uint64_t count = 0;
+    if (!m_exit && read(fd, &count, sizeof(count)) < 0) {}
+}
+
+template<typename T, size_t SIZE>
+void Spsc_Queue<T, SIZE>::wake(std::atomic<bool>& parked, int fd)
+{
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (parked.load(std::memory_order_relaxed))
+    {
+        uint64_t one = 1;
+        if (write(fd, &one, sizeof(one)) < 0) {}
+    }
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <utility>
+
+//Lock-free ring buffer for exactly one producer thread and one consumer thread.
+//Nothing blocks and nothing is allocated after construction - when the ring is full try_push fails,
+// when it's empty try_pop fails and the caller decides whether to wait, retry or drop.
+template<typename T, size_t SIZE> class Spsc_Ring
+{
+public:
+    static_assert(SIZE >= 2 && (SIZE & (SIZE - 1)) == 0, "The size has to be a power of 2");
+
+    //producer side
+    bool try_push(T const& t);
+    bool try_push(T&& t);
+
+    //consumer side
+    bool try_pop(T& dst);
+
+    //approximate when called from a third thread
+    bool empty() const;
+    size_t size() const;
+    static constexpr size_t capacity() { return SIZE; }
+
+private:
+    template<typename U> bool _try_push(U&& t);
+
+    std::array<T, SIZE> m_items;
+
+    //on separate cache lines so the producer and the consumer don't fight over them
+    alignas(64) std::atomic<size_t> m_head = { 0 }; //next to pop, written by the consumer
+    alignas(64) std::atomic<size_t> m_tail = { 0 }; //next to push, written by the producer
+};
+
+
+template<typename T, size_t SIZE>
+bool Spsc_Ring<T, SIZE>::try_push(T const& t)
+{
+    return _try_push(t);
+}
+
+template<typename T, size_t SIZE>
+bool Spsc_Ring<T, SIZE>::try_push(T&& t)
+{
+    return _try_push(std::move(t));
+}
+
+template<typename T, size_t SIZE>
+template<typename U>
+bool Spsc_Ring<T, SIZE>::_try_push(U&& t)
+{
+    size_t tail = m_tail.load(std::memory_order_relaxed);
+    if (tail - m_head.load(std::memory_order_acquire) >= SIZE)
+    {
+        return false;
+    }
+    m_items[tail & (SIZE - 1)] = std::forward<U>(t);
+    m_tail.store(tail + 1, std::memory_order_release);
+    return true;
+}
+
+template<typename T, size_t SIZE>
+bool Spsc_Ring<T, SIZE>::try_pop(T& dst)
+{
+    size_t head = m_head.load(std::memory_order_relaxed);
+    if (head == m_tail.load(std::memory_order_acquire))
+    {
+        return false;
+    }
+    T& item = m_items[head & (SIZE - 1)];
+    dst = std::move(item);
+    item = T(); //don't keep the moved from object (and whatever it holds) alive in the ring
+    m_head.store(head + 1, std::memory_order_release);
+    return true;
+}
+
+template<typename T, size_t SIZE>
+bool Spsc_Ring<T, SIZE>::empty() const
+{
+    return m_head.load(std::memory_order_acquire) == m_tail.load(std::memory_order_acquire);
+}
+
+template<typename T, size_t SIZE>
+size_t Spsc_Ring<T, SIZE>::size() const
+{
+    size_t head = m_head.load(std::memory_order_acquire);
+    return m_tail.load(std::memory_order_acquire) - head;
+}
@@ -0,0 +1,494 @@
+#pragma once
+
+#include <array>
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <cassert>
+#include <cstring>
+#include <sys/uio.h>
+#include "Fec_Encoder.h"
+#include "utils/fec.h"
+
+//A Fec_Encoder with the coding params and the mtu fixed at compile time, for links that run a single configuration.
+//It speaks the same wire format as Fec_Encoder so either end can be replaced by the other one as long as the
+// dynamic end uses the same K, N and mtu and no interleaving.
+//
+//All the storage is in std::arrays sized from the template params, there are no pools, queues or threads:
+// the encoded/decoded datagrams are delivered synchronously from add_tx_packet/add_rx_packet.
+//The RX keeps a window of RX_WINDOW blocks indexed by block_index % RX_WINDOW with a bitmask of the received datagrams.
+//A datagram with a new session id restarts the window, the same as in Fec_Encoder.
+//
+//The output goes to the Sink base class: anything with on_tx_data_encoded(data, size) and on_rx_data_decoded(data, size)
+// callable. The default one holds std::functions, a sink with plain member functions gets inlined in the coding loops.
+
+//The default sink. Leave the callbacks as they are or set them, but don't set them to null
+struct Static_Fec_Function_Sink
+{
+    //sync, called from add_tx_packet
+    std::function<void(void const* data, size_t size)> on_tx_data_encoded = [](void const*, size_t) {};
+
+    //sync, called from add_rx_packet
+    std::function<void(void const* data, size_t size)> on_rx_data_decoded = [](void const*, size_t) {};
+};
+
+template <uint8_t K, uint8_t N, size_t MTU, typename Sink = Static_Fec_Function_Sink>
+class Static_Fec_Encoder : public Sink
+{
+public:
+    static_assert(K > 0 && N >= K && K <= Fec_Encoder::MAX_CODING_K && N <= Fec_Encoder::MAX_CODING_N, "Invalid coding params");
+    static_assert(MTU > 0, "Invalid mtu");
+
+    typedef Fec_Encoder::Clock Clock;
+    typedef Fec_Encoder::Datagram_Header Datagram_Header;
+
+    static const size_t PACKET_SIZE = sizeof(Datagram_Header) + MTU;
+    static const size_t RX_WINDOW = 4;
+
+    Static_Fec_Encoder() = default;
+    ~Static_Fec_Encoder();
+
+    Static_Fec_Encoder(Static_Fec_Encoder const&) = delete;
+    Static_Fec_Encoder& operator=(Static_Fec_Encoder const&) = delete;
+
+    //is_checksummed: same as Fec_Encoder::TX_Descriptor::is_checksummed. The RX always checks the crcs
+    bool init_tx(uint8_t stream_id, bool is_checksummed = false);
+    //session_timeout: same as Fec_Encoder::RX_Descriptor::session_timeout
+    bool init_rx(uint8_t stream_id, Clock::duration reset_duration = std::chrono::milliseconds(1000),
+                 Clock::duration session_timeout = std::chrono::milliseconds(100));
+
+    //add the received, encoded packets here. block is ignored, this never blocks
+    bool add_rx_packet(void const* data, size_t size, bool block);
+
+    //add un-encoded packets to be sent here. block is ignored, this never blocks
+    bool add_tx_packet(void const* data, size_t size, bool block);
+    bool add_tx_packet(iovec const* iov, size_t count, bool block);
+
+    size_t get_mtu() const { return MTU; }
+    size_t get_data_size() const { return MTU; } //no encryption support
+
+private:
+    typedef std::array<uint8_t, PACKET_SIZE> Datagram;
+
+    void seal_tx_datagram(size_t datagram_index);
+    void encode_tx_block();
+
+    void reset_rx_block(size_t slot, uint32_t block_index);
+    void process_rx_blocks();
+    void decode_rx_block(size_t slot);
+    void deliver_rx_datagrams(size_t slot);
+
+    fec_t* m_fec = nullptr;
+    uint8_t m_stream_id = 0;
+
+    std::array<uint8_t const*, K> m_fec_src_datagram_ptrs;
+    std::array<uint8_t*, N> m_fec_dst_datagram_ptrs;
+
+    ////////
+    //TX
+    std::array<Datagram, N> m_tx_datagrams;
+    size_t m_tx_crt_datagram = 0;
+    size_t m_tx_crt_size = 0;
+    uint32_t m_tx_block_index = 1;
+    uint16_t m_tx_session_id = 0;
+    bool m_tx_is_checksummed = false;
+
+    ////////
+    //RX
+    struct RX_Block
+    {
+        bool is_used = false;
+        uint32_t block_index = 0;
+        uint32_t received_mask = 0; //bit i set when datagram i is in datagrams[i]
+        uint32_t processed_mask = 0; //bit i set when primary i was delivered
+        std::array<Datagram, N> datagrams;
+    };
+    std::array<RX_Block, RX_WINDOW> m_rx_blocks;
+    uint32_t m_rx_next_block_index = 0;
+    uint16_t m_rx_session_id = 0;
+    uint16_t m_rx_previous_session_id = 0;
+    Clock::duration m_rx_reset_duration = std::chrono::milliseconds(1000);
+    Clock::duration m_rx_session_timeout = std::chrono::milliseconds(100);
+    Clock::time_point m_rx_last_datagram_tp = Clock::now();
+    Clock::time_point m_rx_last_session_datagram_tp = Clock::now();
+    uint16_t m_rx_candidate_session_id = 0; //see Fec_Encoder::SESSION_SWITCH_DATAGRAMS
+    size_t m_rx_candidate_datagrams = 0;
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+template <uint8_t K, uint8_t N, size_t MTU, typename Sink>
+const size_t Static_Fec_Encoder<K, N, MTU, Sink>::PACKET_SIZE;
+
+template <uint8_t K, uint8_t N, size_t MTU, typename Sink>
+const size_t Static_Fec_Encoder<K, N, MTU, Sink>::RX_WINDOW;
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+template <uint8_t K, uint8_t N, size_t MTU, typename Sink>
+Static_Fec_Encoder<K, N, MTU, Sink>::~Static_Fec_Encoder()
+{
+    if (m_fec)
+    {
+        fec_free(m_fec);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+template <uint8_t K, uint8_t N, size_t MTU, typename Sink>
+bool Static_Fec_Encoder<K, N, MTU, Sink>::init_tx(uint8_t stream_id, bool is_checksummed)
+{
+    if (m_fec)
+    {
+        return false;
+    }
+
+    m_stream_id = stream_id;
+    m_tx_session_id = Fec_Encoder::generate_session_id();
+    m_tx_is_checksummed = is_checksummed;
+    m_fec = fec_new(K, N);
+    return m_fec != nullptr;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+template <uint8_t K, uint8_t N, size_t MTU, typename Sink>
+bool Static_Fec_Encoder<K, N, MTU, Sink>::init_rx(uint8_t stream_id, Clock::duration reset_duration, Clock::duration session_timeout)
+{
+    if (m_fec)
+    {
+        return false;
+    }
+
+    m_stream_id = stream_id;
+    m_rx_reset_duration = reset_duration;
+    m_rx_session_timeout = session_timeout;
+    m_fec = fec_new(K, N);
+    return m_fec != nullptr;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+template <uint8_t K, uint8_t N, size_t MTU, typename Sink>
+void Static_Fec_Encoder<K, N, MTU, Sink>::seal_tx_datagram(size_t datagram_index)
+{
+    Datagram_Header& header = *reinterpret_cast<Datagram_Header*>(m_tx_datagrams[datagram_index].data());
+    header.size = PACKET_SIZE;
+    header.block_index = m_tx_block_index;
+    header.datagram_index = datagram_index;
+    header.coding_k = K;
+    header.coding_n = N;
+    header.stream_id = m_stream_id;
+    header.session_id = m_tx_session_id;
+    header.crc = m_tx_is_checksummed ? Fec_Encoder::get_datagram_crc(header, m_tx_datagrams[datagram_index].data() + sizeof(Datagram_Header), MTU) : 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+template <uint8_t K, uint8_t N, size_t MTU, typename Sink>
+void Static_Fec_Encoder<K, N, MTU, Sink>::encode_tx_block()
+{
+    static const unsigned s_block_nums[] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9,
+                                             10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 20,
+                                             21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31 };
+
+    for (size_t i = 0; i < K; i++)
+    {
+        m_fec_src_datagram_ptrs[i] = m_tx_datagrams[i].data() + sizeof(Datagram_Header);
+    }
+    for (size_t i = K; i < N; i++)
+    {
+        m_fec_dst_datagram_ptrs[i - K] = m_tx_datagrams[i].data() + sizeof(Datagram_Header);
+    }
+
+    fec_encode(m_fec, m_fec_src_datagram_ptrs.data(), m_fec_dst_datagram_ptrs.data(), s_block_nums + K, N - K, MTU);
+
+    for (size_t i = K; i < N; i++)
+    {
+        seal_tx_datagram(i);
+        this->on_tx_data_encoded(m_tx_datagrams[i].data(), PACKET_SIZE);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+template <uint8_t K, uint8_t N, size_t MTU, typename Sink>
+bool Static_Fec_Encoder<K, N, MTU, Sink>::add_tx_packet(void const* data, size_t size, bool block)
+{
+    iovec iov;
+    iov.iov_base = const_cast<void*>(data);
+    iov.iov_len = size;
+    return add_tx_packet(&iov, 1, block);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+template <uint8_t K, uint8_t N, size_t MTU, typename Sink>
+bool Static_Fec_Encoder<K, N, MTU, Sink>::add_tx_packet(iovec const* iov, size_t count, bool block)
+{
+    if (!m_fec)
+    {
+        return false;
+    }
+
+    for (size_t i = 0; i < count; i++)
+    {
+        uint8_t const* data = reinterpret_cast<uint8_t const*>(iov[i].iov_base);
+        size_t size = iov[i].iov_len;
+
+        while (size > 0)
+        {
+            size_t s = std::min(size, MTU - m_tx_crt_size);
+            memcpy(m_tx_datagrams[m_tx_crt_datagram].data() + sizeof(Datagram_Header) + m_tx_crt_size, data, s);
+            m_tx_crt_size += s;
+            data += s;
+            size -= s;
+
+            if (m_tx_crt_size >= MTU)
+            {
+                seal_tx_datagram(m_tx_crt_datagram);
+                this->on_tx_data_encoded(m_tx_datagrams[m_tx_crt_datagram].data(), PACKET_SIZE);
+                m_tx_crt_size = 0;
+                m_tx_crt_datagram++;
+
+                if (m_tx_crt_datagram >= K)
+                {
+                    encode_tx_block();
+                    m_tx_crt_datagram = 0;
+                    m_tx_block_index = (m_tx_block_index + 1) & Fec_Encoder::BLOCK_INDEX_MASK;
+                }
+            }
+        }
+    }
+
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+template <uint8_t K, uint8_t N, size_t MTU, typename Sink>
+void Static_Fec_Encoder<K, N, MTU, Sink>::reset_rx_block(size_t slot, uint32_t block_index)
+{
+    RX_Block& block = m_rx_blocks[slot];
+    block.is_used = true;
+    block.block_index = block_index;
+    block.received_mask = 0;
+    block.processed_mask = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+template <uint8_t K, uint8_t N, size_t MTU, typename Sink>
+bool Static_Fec_Encoder<K, N, MTU, Sink>::add_rx_packet(void const* _data, size_t size, bool block)
+{
+    if (!m_fec)
+    {
+        return false;
+    }
+    if (!_data || size == 0)
+    {
+        return false;
+    }
+
+    uint8_t const* data = reinterpret_cast<uint8_t const*>(_data);
+
+    //anything not matching the compile time configuration is ignored
+    if (size != PACKET_SIZE)
+    {
+        return true;
+    }
+    Datagram_Header const& header = *reinterpret_cast<Datagram_Header const*>(data);
+    if (header.stream_id != m_stream_id || header.coding_k != K || header.coding_n != N || header.datagram_index >= N)
+    {
+        return true;
+    }
+    if (!Fec_Encoder::is_datagram_intact(header, data + sizeof(Datagram_Header), MTU))
+    {
+        return true;
+    }
+
+    uint32_t block_index = header.block_index;
+    uint32_t datagram_index = header.datagram_index;
+
+    if (Clock::now() - m_rx_last_datagram_tp > m_rx_reset_duration)
+    {
+        //nothing usable for a while, start over even if the session is the same
+        m_rx_session_id = 0;
+        m_rx_previous_session_id = 0;
+    }
+
+    if (header.session_id != m_rx_session_id)
+    {
+        if (header.session_id == 0 || header.session_id == m_rx_previous_session_id)
+        {
+            return true;
+        }
+
+        //a live session is only left for a new one that looks real: a few datagrams in a row or the current one went silent
+        if (header.session_id != m_rx_candidate_session_id)
+        {
+            m_rx_candidate_session_id = header.session_id;
+            m_rx_candidate_datagrams = 0;
+        }
+        m_rx_candidate_datagrams++;
+        bool is_silent = Clock::now() - m_rx_last_session_datagram_tp >= m_rx_session_timeout;
+        if (m_rx_session_id != 0 && !is_silent && m_rx_candidate_datagrams < Fec_Encoder::SESSION_SWITCH_DATAGRAMS)
+        {
+            return true;
+        }
+
+        //the transmitter restarted, start a new window at this block
+        m_rx_previous_session_id = m_rx_session_id;
+        m_rx_session_id = header.session_id;
+        m_rx_next_block_index = block_index;
+        m_rx_last_datagram_tp = Clock::now();
+        for (RX_Block& b: m_rx_blocks)
+        {
+            b.is_used = false;
+        }
+    }
+    m_rx_candidate_datagrams = 0;
+    m_rx_last_session_datagram_tp = Clock::now();
+
+    if (Fec_Encoder::get_block_index_distance(m_rx_next_block_index, block_index) < 0)
+    {
+        return true;
+    }
+
+    //skip the blocks that don't fit in the window anymore
+    while (Fec_Encoder::get_block_index_distance(m_rx_next_block_index, block_index) >= int32_t(RX_WINDOW))
+    {
+        m_rx_blocks[m_rx_next_block_index % RX_WINDOW].is_used = false;
+        m_rx_next_block_index = (m_rx_next_block_index + 1) & Fec_Encoder::BLOCK_INDEX_MASK;
+        process_rx_blocks();
+    }
+
+    size_t slot = block_index % RX_WINDOW;
+    RX_Block& rx_block = m_rx_blocks[slot];
+    if (!rx_block.is_used || rx_block.block_index != block_index)
+    {
+        reset_rx_block(slot, block_index);
+    }
+
+    uint32_t bit = 1u << datagram_index;
+    if (rx_block.received_mask & bit)
+    {
+        return true; //duplicated
+    }
+
+    memcpy(rx_block.datagrams[datagram_index].data(), data, PACKET_SIZE);
+    rx_block.received_mask |= bit;
+
+    process_rx_blocks();
+
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+template <uint8_t K, uint8_t N, size_t MTU, typename Sink>
+void Static_Fec_Encoder<K, N, MTU, Sink>::deliver_rx_datagrams(size_t slot)
+{
+    RX_Block& block = m_rx_blocks[slot];
+
+    //in order, stopping at the first missing one
+    for (size_t i = 0; i < K; i++)
+    {
+        uint32_t bit = 1u << i;
+        if (!(block.received_mask & bit))
+        {
+            break;
+        }
+        if (!(block.processed_mask & bit))
+        {
+            this->on_rx_data_decoded(block.datagrams[i].data() + sizeof(Datagram_Header), MTU);
+            m_rx_last_datagram_tp = Clock::now();
+            block.processed_mask |= bit;
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+template <uint8_t K, uint8_t N, size_t MTU, typename Sink>
+void Static_Fec_Encoder<K, N, MTU, Sink>::decode_rx_block(size_t slot)
+{
+    RX_Block& block = m_rx_blocks[slot];
+
+    std::array<unsigned int, K> indices;
+    size_t fec_index = K;
+    size_t missing_count = 0;
+    for (size_t i = 0; i < K; i++)
+    {
+        if (block.received_mask & (1u << i))
+        {
+            m_fec_src_datagram_ptrs[i] = block.datagrams[i].data() + sizeof(Datagram_Header);
+            indices[i] = i;
+        }
+        else
+        {
+            //use the next received fec datagram in place of the missing primary
+            while (!(block.received_mask & (1u << fec_index)))
+            {
+                fec_index++;
+            }
+            assert(fec_index < N);
+            m_fec_src_datagram_ptrs[i] = block.datagrams[fec_index].data() + sizeof(Datagram_Header);
+            indices[i] = fec_index;
+            fec_index++;
+
+            //the missing primaries are rebuilt in place
+            m_fec_dst_datagram_ptrs[missing_count++] = block.datagrams[i].data() + sizeof(Datagram_Header);
+        }
+    }
+
+    if (missing_count > 0)
+    {
+        fec_decode(m_fec, m_fec_src_datagram_ptrs.data(), m_fec_dst_datagram_ptrs.data(), indices.data(), MTU);
+        block.received_mask |= (1u << K) - 1;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+template <uint8_t K, uint8_t N, size_t MTU, typename Sink>
+void Static_Fec_Encoder<K, N, MTU, Sink>::process_rx_blocks()
+{
+    while (true)
+    {
+        //the oldest block in the window is next, blocks that were lost completely are skipped
+        size_t slot = 0;
+        size_t i = 0;
+        for (; i < RX_WINDOW; i++)
+        {
+            slot = (m_rx_next_block_index + i) % RX_WINDOW;
+            if (m_rx_blocks[slot].is_used)
+            {
+                break;
+            }
+        }
+        if (i >= RX_WINDOW)
+        {
+            return;
+        }
+        RX_Block& block = m_rx_blocks[slot];
+        m_rx_next_block_index = block.block_index;
+
+        //try to process consecutive datagrams before the block is finished to minimize latency
+        deliver_rx_datagrams(slot);
+
+        if (size_t(__builtin_popcount(block.received_mask)) < K)
+        {
+            return;
+        }
+
+        decode_rx_block(slot);
+        deliver_rx_datagrams(slot);
+
+        block.is_used = false;
+        m_rx_next_block_index = (m_rx_next_block_index + 1) & Fec_Encoder::BLOCK_INDEX_MASK;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
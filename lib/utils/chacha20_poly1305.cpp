@@ -0,0 +1,288 @@
+/**
+ * ChaCha20-Poly1305 AEAD as specified in RFC 8439.
+ * Poly1305 uses 26 bit limbs (after poly1305-donna) so it's fast on 32 bit CPUs like the Raspberry Pi.
+ */
+
+#include "chacha20_poly1305.h"
+
+#include <string.h>
+
+static inline uint32_t load32_le(const uint8_t* p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline void store32_le(uint8_t* p, uint32_t v)
+{
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+    p[2] = (uint8_t)(v >> 16);
+    p[3] = (uint8_t)(v >> 24);
+}
+
+static inline void store64_le(uint8_t* p, uint64_t v)
+{
+    store32_le(p, (uint32_t)v);
+    store32_le(p + 4, (uint32_t)(v >> 32));
+}
+
+/*
+ * ChaCha20
+ */
+
+#define ROTL32(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+
+#define QUARTER_ROUND(a, b, c, d) \
+    a += b; d ^= a; d = ROTL32(d, 16); \
+    c += d; b ^= c; b = ROTL32(b, 12); \
+    a += b; d ^= a; d = ROTL32(d, 8); \
+    c += d; b ^= c; b = ROTL32(b, 7);
+
+static void chacha20_init(uint32_t state[16], const uint8_t key[32], const uint8_t nonce[12], uint32_t counter)
+{
+    state[0] = 0x61707865;
+    state[1] = 0x3320646e;
+    state[2] = 0x79622d32;
+    state[3] = 0x6b206574;
+    for (int i = 0; i < 8; i++)
+    {
+        state[4 + i] = load32_le(key + 4 * i);
+    }
+    state[12] = counter;
+    state[13] = load32_le(nonce);
+    state[14] = load32_le(nonce + 4);
+    state[15] = load32_le(nonce + 8);
+}
+
+static void chacha20_block(const uint32_t state[16], uint8_t out[64])
+{
+    uint32_t x[16];
+    memcpy(x, state, sizeof(x));
+
+    for (int i = 0; i < 10; i++)
+    {
+        QUARTER_ROUND(x[0], x[4], x[8], x[12]);
+        QUARTER_ROUND(x[1], x[5], x[9], x[13]);
+        QUARTER_ROUND(x[2], x[6], x[10], x[14]);
+        QUARTER_ROUND(x[3], x[7], x[11], x[15]);
+        QUARTER_ROUND(x[0], x[5], x[10], x[15]);
+        QUARTER_ROUND(x[1], x[6], x[11], x[12]);
+        QUARTER_ROUND(x[2], x[7], x[8], x[13]);
+        QUARTER_ROUND(x[3], x[4], x[9], x[14]);
+    }
+
+    for (int i = 0; i < 16; i++)
+    {
+        store32_le(out + 4 * i, x[i] + state[i]);
+    }
+}
+
+static void chacha20_xor(uint32_t state[16], const uint8_t* src, uint8_t* dst, size_t size)
+{
+    uint8_t block[64];
+    while (size > 0)
+    {
+        chacha20_block(state, block);
+        state[12]++;
+
+        size_t s = size < 64 ? size : 64;
+        for (size_t i = 0; i < s; i++)
+        {
+            dst[i] = src[i] ^ block[i];
+        }
+        src += s;
+        dst += s;
+        size -= s;
+    }
+}
+
+/*
+ * Poly1305
+ */
+
+struct poly1305_t
+{
+    uint32_t r[5];
+    uint32_t h[5];
+    uint32_t pad[4];
+};
+
+static void poly1305_init(poly1305_t* st, const uint8_t key[32])
+{
+    st->r[0] = (load32_le(key + 0)) & 0x3ffffff;
+    st->r[1] = (load32_le(key + 3) >> 2) & 0x3ffff03;
+    st->r[2] = (load32_le(key + 6) >> 4) & 0x3ffc0ff;
+    st->r[3] = (load32_le(key + 9) >> 6) & 0x3f03fff;
+    st->r[4] = (load32_le(key + 12) >> 8) & 0x00fffff;
+
+    memset(st->h, 0, sizeof(st->h));
+
+    for (int i = 0; i < 4; i++)
+    {
+        st->pad[i] = load32_le(key + 16 + 4 * i);
+    }
+}
+
+/* size has to be a multiple of 16. The AEAD pads everything with zeros to 16 bytes so there are never partial blocks */
+static void poly1305_blocks(poly1305_t* st, const uint8_t* m, size_t size)
+{
+    const uint32_t hibit = 1UL << 24;
+    const uint32_t r0 = st->r[0], r1 = st->r[1], r2 = st->r[2], r3 = st->r[3], r4 = st->r[4];
+    const uint32_t s1 = r1 * 5, s2 = r2 * 5, s3 = r3 * 5, s4 = r4 * 5;
+    uint32_t h0 = st->h[0], h1 = st->h[1], h2 = st->h[2], h3 = st->h[3], h4 = st->h[4];
+
+    while (size >= 16)
+    {
+        h0 += (load32_le(m + 0)) & 0x3ffffff;
+        h1 += (load32_le(m + 3) >> 2) & 0x3ffffff;
+        h2 += (load32_le(m + 6) >> 4) & 0x3ffffff;
+        h3 += (load32_le(m + 9) >> 6) & 0x3ffffff;
+        h4 += (load32_le(m + 12) >> 8) | hibit;
+
+        uint64_t d0 = (uint64_t)h0 * r0 + (uint64_t)h1 * s4 + (uint64_t)h2 * s3 + (uint64_t)h3 * s2 + (uint64_t)h4 * s1;
+        uint64_t d1 = (uint64_t)h0 * r1 + (uint64_t)h1 * r0 + (uint64_t)h2 * s4 + (uint64_t)h3 * s3 + (uint64_t)h4 * s2;
+        uint64_t d2 = (uint64_t)h0 * r2 + (uint64_t)h1 * r1 + (uint64_t)h2 * r0 + (uint64_t)h3 * s4 + (uint64_t)h4 * s3;
+        uint64_t d3 = (uint64_t)h0 * r3 + (uint64_t)h1 * r2 + (uint64_t)h2 * r1 + (uint64_t)h3 * r0 + (uint64_t)h4 * s4;
+        uint64_t d4 = (uint64_t)h0 * r4 + (uint64_t)h1 * r3 + (uint64_t)h2 * r2 + (uint64_t)h3 * r1 + (uint64_t)h4 * r0;
+
+        uint32_t c;
+        c = (uint32_t)(d0 >> 26); h0 = (uint32_t)d0 & 0x3ffffff;
+        d1 += c; c = (uint32_t)(d1 >> 26); h1 = (uint32_t)d1 & 0x3ffffff;
+        d2 += c; c = (uint32_t)(d2 >> 26); h2 = (uint32_t)d2 & 0x3ffffff;
+        d3 += c; c = (uint32_t)(d3 >> 26); h3 = (uint32_t)d3 & 0x3ffffff;
+        d4 += c; c = (uint32_t)(d4 >> 26); h4 = (uint32_t)d4 & 0x3ffffff;
+        h0 += c * 5; c = h0 >> 26; h0 &= 0x3ffffff;
+        h1 += c;
+
+        m += 16;
+        size -= 16;
+    }
+
+    st->h[0] = h0; st->h[1] = h1; st->h[2] = h2; st->h[3] = h3; st->h[4] = h4;
+}
+
+/* feeds data followed by zeros up to a multiple of 16 */
+static void poly1305_padded(poly1305_t* st, const uint8_t* m, size_t size)
+{
+    size_t full = size & ~(size_t)15;
+    poly1305_blocks(st, m, full);
+    if (full < size)
+    {
+        uint8_t block[16] = { 0 };
+        memcpy(block, m + full, size - full);
+        poly1305_blocks(st, block, 16);
+    }
+}
+
+static void poly1305_finish(poly1305_t* st, uint8_t mac[16])
+{
+    uint32_t h0 = st->h[0], h1 = st->h[1], h2 = st->h[2], h3 = st->h[3], h4 = st->h[4];
+
+    /* fully carry h */
+    uint32_t c;
+    c = h1 >> 26; h1 &= 0x3ffffff;
+    h2 += c; c = h2 >> 26; h2 &= 0x3ffffff;
+    h3 += c; c = h3 >> 26; h3 &= 0x3ffffff;
+    h4 += c; c = h4 >> 26; h4 &= 0x3ffffff;
+    h0 += c * 5; c = h0 >> 26; h0 &= 0x3ffffff;
+    h1 += c;
+
+    /* compute h + -p */
+    uint32_t g0 = h0 + 5; c = g0 >> 26; g0 &= 0x3ffffff;
+    uint32_t g1 = h1 + c; c = g1 >> 26; g1 &= 0x3ffffff;
+    uint32_t g2 = h2 + c; c = g2 >> 26; g2 &= 0x3ffffff;
+    uint32_t g3 = h3 + c; c = g3 >> 26; g3 &= 0x3ffffff;
+    uint32_t g4 = h4 + c - (1UL << 26);
+
+    /* select h if h < p, or h + -p if h >= p, without branches */
+    uint32_t mask = (g4 >> 31) - 1;
+    g0 &= mask; g1 &= mask; g2 &= mask; g3 &= mask; g4 &= mask;
+    mask = ~mask;
+    h0 = (h0 & mask) | g0;
+    h1 = (h1 & mask) | g1;
+    h2 = (h2 & mask) | g2;
+    h3 = (h3 & mask) | g3;
+    h4 = (h4 & mask) | g4;
+
+    /* h = h % 2^128 */
+    h0 = (h0 | (h1 << 26));
+    h1 = ((h1 >> 6) | (h2 << 20));
+    h2 = ((h2 >> 12) | (h3 << 14));
+    h3 = ((h3 >> 18) | (h4 << 8));
+
+    /* mac = (h + pad) % 2^128 */
+    uint64_t f;
+    f = (uint64_t)h0 + st->pad[0]; h0 = (uint32_t)f;
+    f = (uint64_t)h1 + st->pad[1] + (f >> 32); h1 = (uint32_t)f;
+    f = (uint64_t)h2 + st->pad[2] + (f >> 32); h2 = (uint32_t)f;
+    f = (uint64_t)h3 + st->pad[3] + (f >> 32); h3 = (uint32_t)f;
+
+    store32_le(mac + 0, h0);
+    store32_le(mac + 4, h1);
+    store32_le(mac + 8, h2);
+    store32_le(mac + 12, h3);
+}
+
+/*
+ * AEAD
+ */
+
+static void compute_tag(const uint32_t state[16], const uint8_t* aad, size_t aad_size, const uint8_t* ciphertext, size_t size, uint8_t tag[16])
+{
+    /* the one time poly1305 key is the first half of block 0 */
+    uint8_t block[64];
+    chacha20_block(state, block);
+
+    poly1305_t st;
+    poly1305_init(&st, block);
+    poly1305_padded(&st, aad, aad_size);
+    poly1305_padded(&st, ciphertext, size);
+
+    uint8_t lengths[16];
+    store64_le(lengths, aad_size);
+    store64_le(lengths + 8, size);
+    poly1305_blocks(&st, lengths, 16);
+
+    poly1305_finish(&st, tag);
+}
+
+void chacha20_poly1305_encrypt(const uint8_t key[CHACHA20_POLY1305_KEY_SIZE], const uint8_t nonce[CHACHA20_POLY1305_NONCE_SIZE],
+                               const uint8_t* aad, size_t aad_size,
+                               const uint8_t* src, uint8_t* dst, size_t size,
+                               uint8_t tag[CHACHA20_POLY1305_TAG_SIZE])
+{
+    uint32_t state[16];
+    chacha20_init(state, key, nonce, 1);
+    chacha20_xor(state, src, dst, size);
+
+    /* the tag is computed over the ciphertext */
+    state[12] = 0;
+    compute_tag(state, aad, aad_size, dst, size, tag);
+}
+
+int chacha20_poly1305_decrypt(const uint8_t key[CHACHA20_POLY1305_KEY_SIZE], const uint8_t nonce[CHACHA20_POLY1305_NONCE_SIZE],
+                              const uint8_t* aad, size_t aad_size,
+                              const uint8_t* src, uint8_t* dst, size_t size,
+                              const uint8_t tag[CHACHA20_POLY1305_TAG_SIZE])
+{
+    uint32_t state[16];
+    chacha20_init(state, key, nonce, 0);
+
+    uint8_t computed_tag[CHACHA20_POLY1305_TAG_SIZE];
+    compute_tag(state, aad, aad_size, src, size, computed_tag);
+
+    /* constant time compare */
+    uint8_t diff = 0;
+    for (int i = 0; i < CHACHA20_POLY1305_TAG_SIZE; i++)
+    {
+        diff |= computed_tag[i] ^ tag[i];
+    }
+    if (diff != 0)
+    {
+        return 0;
+    }
+
+    state[12] = 1;
+    chacha20_xor(state, src, dst, size);
+    return 1;
+}
@@ -0,0 +1,32 @@
+/**
+ * ChaCha20-Poly1305 AEAD as specified in RFC 8439.
+ * Plain portable C, no tables, so the timing doesn't depend on the key or the data.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CHACHA20_POLY1305_KEY_SIZE 32
+#define CHACHA20_POLY1305_NONCE_SIZE 12
+#define CHACHA20_POLY1305_TAG_SIZE 16
+
+/**
+ * Encrypts size bytes from src to dst and computes the tag over aad and the ciphertext.
+ * src and dst can be the same buffer.
+ */
+void chacha20_poly1305_encrypt(const uint8_t key[CHACHA20_POLY1305_KEY_SIZE], const uint8_t nonce[CHACHA20_POLY1305_NONCE_SIZE],
+                               const uint8_t* aad, size_t aad_size,
+                               const uint8_t* src, uint8_t* dst, size_t size,
+                               uint8_t tag[CHACHA20_POLY1305_TAG_SIZE]);
+
+/**
+ * Checks the tag and only if it matches decrypts size bytes from src to dst.
+ * src and dst can be the same buffer.
+ * @return 1 if the data is authentic, 0 otherwise (and dst is untouched)
+ */
+int chacha20_poly1305_decrypt(const uint8_t key[CHACHA20_POLY1305_KEY_SIZE], const uint8_t nonce[CHACHA20_POLY1305_NONCE_SIZE],
+                              const uint8_t* aad, size_t aad_size,
+                              const uint8_t* src, uint8_t* dst, size_t size,
+                              const uint8_t tag[CHACHA20_POLY1305_TAG_SIZE]);
@@ -0,0 +1,16 @@
+/**
+ * CRC32C (Castagnoli, the iSCSI/SCTP polynomial).
+ * Uses the SSE4.2 crc32 instruction when the CPU has it (checked at runtime), the ARMv8 crc32c instructions when
+ * the compiler targets them and slicing-by-8 tables otherwise.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Continues crc (0 to start) over size bytes of data, so split buffers can be checksummed in pieces.
+ * @return crc32c(data) for crc 0
+ */
+uint32_t crc32c(uint32_t crc, const void* data, size_t size);
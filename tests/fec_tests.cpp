@@ -0,0 +1,955 @@
+#include "Fec_Encoder.h"
+#include "Static_Fec_Encoder.h"
+#include "Compressor.h"
+#include "Mux.h"
+#include <iostream>
+#include <vector>
+#include <set>
+#include <memory>
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <mutex>
+#include <thread>
+
+//Regression tests for Fec_Encoder. The TX runs in synchronous mode so the datagrams can be dropped, reordered or
+// tampered with deterministically before the RX gets them. The RX too, unless a test needs its thread.
+
+#define CHECK(x) \
+    if (!(x)) \
+    { \
+        std::cerr << "\t" << __FILE__ << ":" << __LINE__ << ": " << #x << "\n"; \
+        return false; \
+    }
+
+typedef std::vector<uint8_t> Datagram;
+
+//A TX in synchronous mode and an RX. The encoded datagrams are kept in sent, the tests decide what the RX gets
+struct Link
+{
+    //written by the RX thread when there is one, so they go before the encoders to outlive it
+    std::mutex mutex;
+    std::vector<uint8_t> decoded;
+    size_t lost_size = 0;
+
+    std::vector<Datagram> sent;
+    Fec_Encoder tx;
+    Fec_Encoder rx;
+
+    bool init(Fec_Encoder::TX_Descriptor tx_descriptor = Fec_Encoder::TX_Descriptor(),
+              Fec_Encoder::RX_Descriptor rx_descriptor = Fec_Encoder::RX_Descriptor(),
+              bool is_rx_threaded = false)
+    {
+        tx_descriptor.is_synchronous = true;
+        rx_descriptor.is_synchronous = !is_rx_threaded;
+        tx.on_tx_data_encoded = [this](void const* data, size_t size)
+        {
+            uint8_t const* d = reinterpret_cast<uint8_t const*>(data);
+            sent.emplace_back(d, d + size);
+        };
+        rx.on_rx_data_decoded = [this](void const* data, size_t size)
+        {
+            std::lock_guard<std::mutex> lg(mutex);
+            uint8_t const* d = reinterpret_cast<uint8_t const*>(data);
+            decoded.insert(decoded.end(), d, d + size);
+        };
+        rx.on_rx_data_lost = [this](uint64_t, size_t size)
+        {
+            std::lock_guard<std::mutex> lg(mutex);
+            lost_size += size;
+        };
+        return tx.init_tx(tx_descriptor) && rx.init_rx(rx_descriptor);
+    }
+
+    //polls until size bytes were decoded or the timeout expires
+    bool wait_for_decoded(size_t size, Fec_Encoder::Clock::duration timeout)
+    {
+        Fec_Encoder::Clock::time_point start = Fec_Encoder::Clock::now();
+        while (Fec_Encoder::Clock::now() - start < timeout)
+        {
+            {
+                std::lock_guard<std::mutex> lg(mutex);
+                if (decoded.size() >= size)
+                {
+                    return true;
+                }
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        return false;
+    }
+
+    //count datagrams worth of data, datagram i filled with the byte i
+    std::vector<uint8_t> send(size_t count)
+    {
+        std::vector<uint8_t> data;
+        std::vector<uint8_t> packet(tx.get_data_size());
+        for (size_t i = 0; i < count; i++)
+        {
+            std::fill(packet.begin(), packet.end(), uint8_t(i));
+            tx.add_tx_packet(packet.data(), packet.size(), true);
+            data.insert(data.end(), packet.begin(), packet.end());
+        }
+        return data;
+    }
+
+    void receive(Datagram const& datagram, size_t receiver = 0)
+    {
+        rx.add_rx_packet(datagram.data(), datagram.size(), true, receiver);
+    }
+};
+
+static Fec_Encoder::Datagram_Header& get_header(Datagram& datagram)
+{
+    return *reinterpret_cast<Fec_Encoder::Datagram_Header*>(datagram.data());
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+//One datagram with another session id (corrupted or spoofed) in the middle of the stream doesn't cut it off
+static bool test_foreign_session_datagram()
+{
+    Link link;
+    CHECK(link.init());
+    std::vector<uint8_t> data = link.send(12 * 10);
+    CHECK(link.sent.size() == 20 * 10);
+
+    for (size_t i = 0; i < link.sent.size(); i++)
+    {
+        if (i == 20 * 3 + 5)
+        {
+            Datagram foreign = link.sent[i];
+            get_header(foreign).session_id ^= 0x5555;
+            link.receive(foreign);
+        }
+        link.receive(link.sent[i]);
+    }
+
+    CHECK(link.decoded == data);
+    CHECK(link.lost_size == 0);
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+//In order, a block that comes in complete after one that was lost entirely is delivered once it's been held for
+// max_block_hold, even if nothing else comes in to wake the RX thread up
+static bool test_block_after_lost_block_released()
+{
+    Fec_Encoder::RX_Descriptor rx_descriptor;
+    rx_descriptor.max_block_hold = std::chrono::milliseconds(50);
+
+    Link link;
+    CHECK(link.init(Fec_Encoder::TX_Descriptor(), rx_descriptor, true));
+    std::vector<uint8_t> data = link.send(12 * 3);
+    CHECK(link.sent.size() == 20 * 3);
+
+    size_t block_size = 12 * link.tx.get_data_size();
+    for (size_t i = 0; i < 20; i++)
+    {
+        link.receive(link.sent[i]);
+    }
+    CHECK(link.wait_for_decoded(block_size, std::chrono::milliseconds(500)));
+
+    //block 1 never shows up
+    Fec_Encoder::Clock::time_point start = Fec_Encoder::Clock::now();
+    for (size_t i = 40; i < 60; i++)
+    {
+        link.receive(link.sent[i]);
+    }
+    CHECK(link.wait_for_decoded(2 * block_size, std::chrono::milliseconds(500)));
+    CHECK(Fec_Encoder::Clock::now() - start >= rx_descriptor.max_block_hold);
+
+    std::lock_guard<std::mutex> lg(link.mutex);
+    CHECK(std::equal(link.decoded.begin(), link.decoded.begin() + block_size, data.begin()));
+    CHECK(std::equal(link.decoded.begin() + block_size, link.decoded.end(), data.begin() + 2 * block_size));
+    CHECK(link.lost_size == block_size);
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+//The first datagram after a pause longer than reset_duration starts the new session, it's not thrown away with the old one
+static bool test_datagram_after_reset()
+{
+    Fec_Encoder::RX_Descriptor rx_descriptor;
+    rx_descriptor.reset_duration = std::chrono::milliseconds(20);
+
+    Link link;
+    CHECK(link.init(Fec_Encoder::TX_Descriptor(), rx_descriptor));
+    std::vector<uint8_t> data = link.send(12 * 2);
+    CHECK(link.sent.size() == 20 * 2);
+
+    for (size_t i = 0; i < 20; i++)
+    {
+        link.receive(link.sent[i]);
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(40));
+    for (size_t i = 20; i < 40; i++)
+    {
+        link.receive(link.sent[i]);
+    }
+
+    CHECK(link.decoded == data);
+    CHECK(link.lost_size == 0);
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+//A restarted TX (a new session, block indices from the start) is switched to after a few of its datagrams while the
+// old session is live, and right away once the old one went silent for session_timeout
+static bool test_restarted_tx_session_switch()
+{
+    Fec_Encoder::RX_Descriptor rx_descriptor;
+    rx_descriptor.session_timeout = std::chrono::milliseconds(20);
+    Link link;
+    CHECK(link.init(Fec_Encoder::TX_Descriptor(), rx_descriptor));
+    std::vector<uint8_t> data = link.send(12 * 2);
+    for (Datagram const& datagram: link.sent)
+    {
+        link.receive(datagram);
+    }
+    CHECK(link.decoded == data);
+
+    //right after the old session, the first SESSION_SWITCH_DATAGRAMS - 1 are rejected and the fec recovers them
+    Link restarted;
+    CHECK(restarted.init());
+    std::vector<uint8_t> restarted_data = restarted.send(12 * 2);
+    CHECK(get_header(restarted.sent[0]).session_id != get_header(link.sent[0]).session_id);
+    for (Datagram const& datagram: restarted.sent)
+    {
+        link.receive(datagram);
+    }
+    data.insert(data.end(), restarted_data.begin(), restarted_data.end());
+    CHECK(link.decoded == data);
+
+    //after a silence the first datagram switches, no fec needed
+    std::this_thread::sleep_for(rx_descriptor.session_timeout + std::chrono::milliseconds(10));
+    Link restarted_again;
+    CHECK(restarted_again.init());
+    std::vector<uint8_t> restarted_again_data = restarted_again.send(12);
+    for (size_t i = 0; i < 12; i++)
+    {
+        link.receive(restarted_again.sent[i]);
+    }
+    data.insert(data.end(), restarted_again_data.begin(), restarted_again_data.end());
+    CHECK(link.decoded == data);
+    CHECK(link.lost_size == 0);
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+//With drop_oldest, the datagrams dropped from a full TX queue show up as a loss on the RX and the data before and after
+// the drop never ends up in the same block
+static bool test_drop_oldest_not_spliced()
+{
+    Fec_Encoder::RX_Descriptor rx_descriptor;
+    rx_descriptor.max_block_hold = std::chrono::milliseconds(1);
+    Link link;
+    CHECK(link.init(Fec_Encoder::TX_Descriptor(), rx_descriptor));
+
+    std::vector<std::pair<uint64_t, uint8_t>> decoded; //offset and packet index of every datagram
+    link.rx.on_rx_data_decoded_at = [&decoded](uint64_t offset, void const* data, size_t)
+    {
+        decoded.emplace_back(offset, *reinterpret_cast<uint8_t const*>(data));
+    };
+
+    //the TX thread stalls on the first datagram it sends so its queue fills up
+    std::mutex gate;
+    std::unique_lock<std::mutex> gate_lock(gate);
+    Fec_Encoder tx;
+    Fec_Encoder::TX_Descriptor tx_descriptor;
+    tx_descriptor.max_enqueued_packets = 24;
+    tx_descriptor.drop_oldest = true;
+    tx.on_tx_data_encoded = [&link, &gate](void const* data, size_t size)
+    {
+        std::lock_guard<std::mutex> lg(gate);
+        uint8_t const* d = reinterpret_cast<uint8_t const*>(data);
+        link.sent.emplace_back(d, d + size);
+    };
+    CHECK(tx.init_tx(tx_descriptor));
+
+    size_t data_size = tx.get_data_size();
+    std::vector<uint8_t> packet(data_size);
+    for (size_t i = 0; i < 120; i++)
+    {
+        std::fill(packet.begin(), packet.end(), uint8_t(i));
+        tx.add_tx_packet(packet.data(), packet.size(), true);
+        if (i == 4)
+        {
+            //some datagrams of the first block make it to the TX thread before the drops
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        }
+    }
+    gate_lock.unlock();
+    CHECK(tx.get_dropped_tx_datagrams() > 0);
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+    for (Datagram const& datagram: link.sent)
+    {
+        link.receive(datagram);
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    link.rx.process();
+
+    CHECK(!decoded.empty());
+    CHECK(link.lost_size > 0);
+
+    //the packets in a block are consecutive, the blocks come in order
+    size_t block_size = 12 * data_size;
+    for (size_t i = 1; i < decoded.size(); i++)
+    {
+        CHECK(decoded[i].second > decoded[i - 1].second);
+        if (decoded[i].first / block_size == decoded[i - 1].first / block_size)
+        {
+            CHECK(static_cast<size_t>(decoded[i].second - decoded[i - 1].second) == (decoded[i].first - decoded[i - 1].first) / data_size);
+        }
+    }
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+//With interleaving, a drop that cuts into a block gives up only that block. The blocks of its interleaving group that
+// were already complete are still sent
+static bool test_drop_oldest_interleaved_keeps_complete_blocks()
+{
+    Fec_Encoder::RX_Descriptor rx_descriptor;
+    rx_descriptor.interleaving_depth = 2;
+    rx_descriptor.max_block_hold = std::chrono::milliseconds(1);
+    Link link;
+    CHECK(link.init(Fec_Encoder::TX_Descriptor(), rx_descriptor));
+
+    std::set<uint8_t> decoded; //packet index of every datagram
+    link.rx.on_rx_data_decoded = [&decoded](void const* data, size_t)
+    {
+        decoded.insert(*reinterpret_cast<uint8_t const*>(data));
+    };
+
+    //The TX thread is stopped with the second group half done: its first block complete and 5 datagrams in the
+    // second one. It stalls when it flushes the held back fec datagrams of the first group because nothing new comes
+    // in, so its queue overflows and the next datagrams of the second block come after a gap
+    std::mutex gate;
+    Fec_Encoder tx;
+    Fec_Encoder::TX_Descriptor tx_descriptor;
+    tx_descriptor.interleaving_depth = 2;
+    tx_descriptor.fec_spread = 1;
+    tx_descriptor.max_enqueued_packets = 24;
+    tx_descriptor.drop_oldest = true;
+    tx.on_tx_data_encoded = [&link, &gate](void const* data, size_t size)
+    {
+        std::lock_guard<std::mutex> lg(gate);
+        uint8_t const* d = reinterpret_cast<uint8_t const*>(data);
+        link.sent.emplace_back(d, d + size);
+    };
+    CHECK(tx.init_tx(tx_descriptor));
+
+    size_t data_size = tx.get_data_size();
+    std::vector<uint8_t> packet(data_size);
+    auto send = [&tx, &packet](size_t first, size_t count)
+    {
+        for (size_t i = first; i < first + count; i++)
+        {
+            std::fill(packet.begin(), packet.end(), uint8_t(i));
+            tx.add_tx_packet(packet.data(), packet.size(), true);
+        }
+    };
+    send(0, 12 * 2 + 12 + 5);
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+    std::unique_lock<std::mutex> gate_lock(gate);
+    std::this_thread::sleep_for(tx_descriptor.fec_flush_timeout + std::chrono::milliseconds(30));
+    send(12 * 2 + 12 + 5, 40);
+    gate_lock.unlock();
+    CHECK(tx.get_dropped_tx_datagrams() > 0);
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+    {
+        std::lock_guard<std::mutex> lg(gate);
+        for (Datagram const& datagram: link.sent)
+        {
+            link.receive(datagram);
+        }
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    link.rx.process();
+
+    //the first block of the second group made it, the one the drop cut into didn't
+    for (size_t i = 12 * 2; i < 12 * 3; i++)
+    {
+        CHECK(decoded.count(uint8_t(i)) == 1);
+    }
+    CHECK(decoded.count(uint8_t(12 * 3)) == 0);
+    CHECK(link.lost_size > 0);
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+//A compressed frame smaller than a datagram gets out with flush_tx_packet, without waiting for more data, and the
+// decompressor skips the padding
+static bool test_flushed_compressed_frame()
+{
+    Link link;
+    CHECK(link.init());
+
+    Compressor::Descriptor compressor_descriptor;
+    Compressor compressor;
+    Compressor decompressor;
+    CHECK(compressor.init_tx(compressor_descriptor) && decompressor.init_rx(compressor_descriptor));
+    compressor.on_tx_data_compressed = [&link](void const* data, size_t size)
+    {
+        link.tx.add_tx_packet(data, size, true);
+    };
+    link.rx.on_rx_data_decoded = [&decompressor](void const* data, size_t size)
+    {
+        decompressor.add_rx_packet(data, size);
+    };
+    std::string decompressed;
+    decompressor.on_rx_data_decompressed = [&decompressed](void const* data, size_t size)
+    {
+        decompressed.append(reinterpret_cast<char const*>(data), size);
+    };
+
+    std::string text = "a short log line\n";
+    for (size_t i = 0; i < 2 * 12; i++)
+    {
+        compressor.add_tx_packet(text.data(), text.size());
+        CHECK(compressor.flush_tx());
+        CHECK(link.tx.flush_tx_packet(true));
+    }
+    CHECK(link.tx.flush_tx_packet(true)); //nothing left, no padding only datagram
+    CHECK(link.sent.size() == 20 * 2);
+
+    for (Datagram const& datagram: link.sent)
+    {
+        link.receive(datagram);
+    }
+
+    std::string expected;
+    for (size_t i = 0; i < 2 * 12; i++)
+    {
+        expected += text;
+    }
+    CHECK(decompressed == expected);
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+//A frame header that's a false positive (the magic in the data of a frame cut by a lost datagram) doesn't hold back
+// the complete frame after it while the decompressor waits for the false frame's bytes
+static bool test_false_frame_header_not_waited_for()
+{
+    Compressor::Descriptor compressor_descriptor;
+    Compressor compressor;
+    Compressor decompressor;
+    CHECK(compressor.init_tx(compressor_descriptor) && decompressor.init_rx(compressor_descriptor));
+    std::vector<uint8_t> compressed;
+    compressor.on_tx_data_compressed = [&compressed](void const* data, size_t size)
+    {
+        uint8_t const* d = reinterpret_cast<uint8_t const*>(data);
+        compressed.insert(compressed.end(), d, d + size);
+    };
+    std::string decompressed;
+    decompressor.on_rx_data_decompressed = [&decompressed](void const* data, size_t size)
+    {
+        decompressed.append(reinterpret_cast<char const*>(data), size);
+    };
+
+    std::string text = "a short log line\n";
+    compressor.add_tx_packet(text.data(), text.size());
+    CHECK(compressor.flush_tx());
+
+    //magic 0x5A43, 100 compressed bytes for 100 uncompressed ones - more than what follows
+    std::vector<uint8_t> stream = { 0x43, 0x5A, 100, 0, 100, 0 };
+    CHECK(compressed.size() < 100);
+    stream.insert(stream.end(), compressed.begin(), compressed.end());
+    decompressor.add_rx_packet(stream.data(), stream.size());
+    CHECK(decompressed == text);
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+//The datagrams left in an output ring can be released after the encoder that pushed them is gone
+static bool test_output_ring_outlives_encoder()
+{
+    Fec_Encoder::Output_Ring ring;
+    {
+        Fec_Encoder tx;
+        Fec_Encoder::TX_Descriptor tx_descriptor;
+        tx_descriptor.is_synchronous = true;
+        tx_descriptor.output_ring = &ring;
+        CHECK(tx.init_tx(tx_descriptor));
+
+        std::vector<uint8_t> packet(tx.get_data_size() * 12);
+        CHECK(tx.add_tx_packet(packet.data(), packet.size(), true));
+    }
+
+    size_t count = 0;
+    Fec_Encoder::Data_ptr data;
+    while (ring.try_pop(data))
+    {
+        data.reset();
+        count++;
+    }
+    CHECK(count > 0);
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+//A datagram isn't exclusive to a receiver when another one delivers it after its block is done with
+static bool test_exclusive_with_late_copies()
+{
+    Link link;
+    CHECK(link.init());
+    link.send(12 * 100);
+    CHECK(link.sent.size() == 20 * 100);
+
+    //receiver 1 gets everything late but datagram 3 of every block
+    for (size_t b = 0; b < 100; b++)
+    {
+        for (size_t i = 0; i < 20; i++)
+        {
+            link.receive(link.sent[b * 20 + i], 0);
+        }
+        for (size_t i = 0; i < 20; i++)
+        {
+            if (i != 3)
+            {
+                link.receive(link.sent[b * 20 + i], 1);
+            }
+        }
+    }
+
+    Fec_Encoder::Stats stats = link.rx.get_stats();
+    CHECK(stats.receivers[0].datagrams_used == 12 * 100);
+    CHECK(stats.receivers[0].datagrams_exclusive > 0);
+    CHECK(stats.receivers[0].datagrams_exclusive <= 100);
+    CHECK(stats.receivers[1].datagrams_exclusive == 0);
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+//Unordered, a block older than the one the session's first datagrams came from can't get offsets that are already
+// delivered
+static bool test_unordered_session_start_offsets()
+{
+    Fec_Encoder::RX_Descriptor rx_descriptor;
+    rx_descriptor.is_unordered = true;
+    Link link;
+    CHECK(link.init(Fec_Encoder::TX_Descriptor(), rx_descriptor));
+
+    std::vector<std::pair<uint64_t, uint8_t>> decoded; //offset and packet index of every datagram
+    link.rx.on_rx_data_decoded_at = [&decoded](uint64_t offset, void const* data, size_t)
+    {
+        decoded.emplace_back(offset, *reinterpret_cast<uint8_t const*>(data));
+    };
+
+    link.send(12 * 3);
+    CHECK(link.sent.size() == 20 * 3);
+
+    //half of block 1, all of block 0, then the rest
+    for (size_t i = 20; i < 26; i++)
+    {
+        link.receive(link.sent[i]);
+    }
+    for (size_t i = 0; i < 20; i++)
+    {
+        link.receive(link.sent[i]);
+    }
+    for (size_t i = 26; i < 60; i++)
+    {
+        link.receive(link.sent[i]);
+    }
+
+    //every offset once and always with the same packet
+    size_t data_size = link.tx.get_data_size();
+    std::set<uint64_t> offsets;
+    CHECK(!decoded.empty());
+    for (std::pair<uint64_t, uint8_t> const& d: decoded)
+    {
+        CHECK(offsets.insert(d.first).second);
+        CHECK(d.second - d.first / data_size == decoded.front().second - decoded.front().first / data_size);
+    }
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+//With interleaving a burst loss longer than the fec datagrams of a block is spread over the blocks of the group and
+// they are all recovered
+static bool test_interleaved_burst_recovered()
+{
+    Fec_Encoder::TX_Descriptor tx_descriptor;
+    tx_descriptor.interleaving_depth = 4;
+    Fec_Encoder::RX_Descriptor rx_descriptor;
+    rx_descriptor.interleaving_depth = 4;
+    Link link;
+    CHECK(link.init(tx_descriptor, rx_descriptor));
+    std::vector<uint8_t> data = link.send(12 * 4 * 2);
+    CHECK(link.sent.size() == 20 * 4 * 2);
+
+    //the datagrams of the group's blocks take turns
+    for (size_t i = 0; i < 4; i++)
+    {
+        CHECK(get_header(link.sent[i]).block_index == get_header(link.sent[0]).block_index + i);
+        CHECK(get_header(link.sent[i]).datagram_index == 0);
+    }
+
+    //24 in a row, 6 from each block of the first group. Without interleaving a whole block would be lost
+    for (size_t i = 0; i < link.sent.size(); i++)
+    {
+        if (i < 10 || i >= 10 + 24)
+        {
+            link.receive(link.sent[i]);
+        }
+    }
+
+    CHECK(link.decoded == data);
+    CHECK(link.lost_size == 0);
+    CHECK(link.rx.get_stats().blocks_recovered == 4);
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+//The coding params change between blocks with set_coding_params and the RX follows from the headers, recovering the
+// blocks of either kind
+static bool test_mixed_coding_params()
+{
+    Link link;
+    CHECK(link.init());
+    std::vector<uint8_t> data = link.send(12 * 2);
+
+    //the block after the current one picks them up, the current one is already started with the old ones
+    CHECK(link.tx.set_coding_params(4, 6));
+    std::vector<uint8_t> more = link.send(12 + 4 * 3);
+    data.insert(data.end(), more.begin(), more.end());
+    CHECK(link.sent.size() == 20 * 3 + 6 * 3);
+    CHECK(get_header(link.sent[20 * 2]).coding_k == 12 && get_header(link.sent[20 * 2]).coding_n == 20);
+    CHECK(get_header(link.sent[20 * 3]).coding_k == 4 && get_header(link.sent[20 * 3]).coding_n == 6);
+
+    //the first 2 primaries of every block are lost
+    for (Datagram& datagram: link.sent)
+    {
+        if (get_header(datagram).datagram_index >= 2)
+        {
+            link.receive(datagram);
+        }
+    }
+
+    CHECK(link.decoded == data);
+    CHECK(link.lost_size == 0);
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+//With fec_spread the fec datagrams of a block go out between the primaries of the next one. Those of the last block
+// are flushed after fec_flush_timeout, and a block that lost as many primaries as it has fec datagrams is recovered
+static bool test_spread_fec_recovered()
+{
+    Fec_Encoder::TX_Descriptor tx_descriptor;
+    tx_descriptor.fec_spread = 2;
+    Link link;
+    CHECK(link.init(tx_descriptor));
+    std::vector<uint8_t> data = link.send(12 * 2);
+
+    //block 0's primaries, then one of its fec datagrams after every 2 primaries of block 1
+    CHECK(link.sent.size() >= 12 + 3);
+    uint32_t first_block_index = get_header(link.sent[0]).block_index;
+    CHECK(get_header(link.sent[12]).block_index == first_block_index + 1);
+    CHECK(get_header(link.sent[14]).block_index == first_block_index);
+    CHECK(get_header(link.sent[14]).datagram_index == 12);
+
+    std::this_thread::sleep_for(tx_descriptor.fec_flush_timeout + std::chrono::milliseconds(5));
+    CHECK(link.tx.process());
+    CHECK(link.sent.size() == 20 * 2);
+
+    //8 primaries of each block lost
+    for (Datagram& datagram: link.sent)
+    {
+        if (get_header(datagram).datagram_index >= 8)
+        {
+            link.receive(datagram);
+        }
+    }
+
+    CHECK(link.decoded == data);
+    CHECK(link.lost_size == 0);
+    CHECK(link.rx.get_stats().blocks_recovered == 2);
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+//The compile time encoder round-trips with losses, and speaks the same wire format as the dynamic one in both directions
+static bool test_static_encoder_round_trip()
+{
+    typedef Static_Fec_Encoder<4, 6, 256> Static_Encoder;
+    std::unique_ptr<Static_Encoder> tx(new Static_Encoder);
+    std::unique_ptr<Static_Encoder> rx(new Static_Encoder);
+    CHECK(tx->init_tx(0, true) && rx->init_rx(0));
+
+    std::vector<Datagram> sent;
+    tx->on_tx_data_encoded = [&sent](void const* data, size_t size)
+    {
+        uint8_t const* d = reinterpret_cast<uint8_t const*>(data);
+        sent.emplace_back(d, d + size);
+    };
+    std::vector<uint8_t> decoded;
+    rx->on_rx_data_decoded = [&decoded](void const* data, size_t size)
+    {
+        uint8_t const* d = reinterpret_cast<uint8_t const*>(data);
+        decoded.insert(decoded.end(), d, d + size);
+    };
+
+    std::vector<uint8_t> data;
+    std::vector<uint8_t> packet(tx->get_data_size());
+    for (size_t i = 0; i < 4 * 3; i++)
+    {
+        std::fill(packet.begin(), packet.end(), uint8_t(i));
+        CHECK(tx->add_tx_packet(packet.data(), packet.size(), true));
+        data.insert(data.end(), packet.begin(), packet.end());
+    }
+    CHECK(sent.size() == 6 * 3);
+
+    //the first 2 primaries of every block are lost
+    for (Datagram& datagram: sent)
+    {
+        if (get_header(datagram).datagram_index >= 2)
+        {
+            CHECK(rx->add_rx_packet(datagram.data(), datagram.size(), true));
+        }
+    }
+    CHECK(decoded == data);
+
+    //static TX to a dynamic RX with the same K, N and mtu
+    Fec_Encoder::RX_Descriptor rx_descriptor;
+    rx_descriptor.coding_k = 4;
+    rx_descriptor.coding_n = 6;
+    rx_descriptor.mtu = 256;
+    Link link;
+    CHECK(link.init(Fec_Encoder::TX_Descriptor(), rx_descriptor));
+    for (Datagram& datagram: sent)
+    {
+        if (get_header(datagram).datagram_index != 1)
+        {
+            link.receive(datagram);
+        }
+    }
+    CHECK(link.decoded == data);
+
+    //and a dynamic TX to a static RX
+    Fec_Encoder::TX_Descriptor tx_descriptor;
+    tx_descriptor.coding_k = 4;
+    tx_descriptor.coding_n = 6;
+    tx_descriptor.mtu = 256;
+    Link dynamic_link;
+    CHECK(dynamic_link.init(tx_descriptor, rx_descriptor));
+    std::vector<uint8_t> dynamic_data = dynamic_link.send(4 * 3);
+    std::unique_ptr<Static_Encoder> static_rx(new Static_Encoder);
+    CHECK(static_rx->init_rx(0));
+    decoded.clear();
+    static_rx->on_rx_data_decoded = rx->on_rx_data_decoded;
+    for (Datagram& datagram: dynamic_link.sent)
+    {
+        if (get_header(datagram).datagram_index != 0)
+        {
+            CHECK(static_rx->add_rx_packet(datagram.data(), datagram.size(), true));
+        }
+    }
+    CHECK(decoded == dynamic_data);
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+//With an encryption key the payloads are ciphertext on the wire, and a tampered primary fails authentication: it's
+// reported lost instead of being delivered
+static bool test_encrypted_tamper_rejected()
+{
+    std::vector<uint8_t> key(Fec_Encoder::ENCRYPTION_KEY_SIZE);
+    for (size_t i = 0; i < key.size(); i++)
+    {
+        key[i] = uint8_t(i * 7 + 1);
+    }
+    Fec_Encoder::TX_Descriptor tx_descriptor;
+    tx_descriptor.encryption_key = key;
+    Fec_Encoder::RX_Descriptor rx_descriptor;
+    rx_descriptor.encryption_key = key;
+    Link link;
+    CHECK(link.init(tx_descriptor, rx_descriptor));
+    std::vector<uint8_t> data = link.send(12 * 2);
+    CHECK(link.sent.size() == 20 * 2);
+
+    //packet 0 is all zeros
+    size_t data_size = link.tx.get_data_size();
+    Datagram const& first = link.sent[0];
+    CHECK(std::any_of(first.begin() + sizeof(Fec_Encoder::Datagram_Header), first.begin() + sizeof(Fec_Encoder::Datagram_Header) + data_size,
+                      [](uint8_t b) { return b != 0; }));
+
+    link.sent[3][sizeof(Fec_Encoder::Datagram_Header) + 10] ^= 0x01;
+    for (Datagram const& datagram: link.sent)
+    {
+        link.receive(datagram);
+    }
+
+    data.erase(data.begin() + 3 * data_size, data.begin() + 4 * data_size);
+    CHECK(link.decoded == data);
+    CHECK(link.lost_size == data_size);
+    CHECK(link.rx.get_stats().datagrams_rejected == 1);
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+//With is_checksummed a corrupted datagram is dropped on arrival and the fec rebuilds it, it never reaches the decoder
+static bool test_corrupted_datagram_dropped()
+{
+    Fec_Encoder::TX_Descriptor tx_descriptor;
+    tx_descriptor.is_checksummed = true;
+    Link link;
+    CHECK(link.init(tx_descriptor));
+    std::vector<uint8_t> data = link.send(12 * 2);
+    CHECK(link.sent.size() == 20 * 2);
+
+    //a primary and a fec datagram, either would spoil the block if they were used
+    link.sent[2][sizeof(Fec_Encoder::Datagram_Header) + 100] ^= 0x10;
+    link.sent[20 + 15][sizeof(Fec_Encoder::Datagram_Header) + 5] ^= 0x80;
+    for (size_t i = 0; i < link.sent.size(); i++)
+    {
+        //block 1 needs its fec datagrams
+        if (i < 20 || i >= 20 + 4)
+        {
+            link.receive(link.sent[i]);
+        }
+    }
+
+    CHECK(link.decoded == data);
+    CHECK(link.lost_size == 0);
+    CHECK(link.rx.get_stats().datagrams_corrupted == 2);
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+//A datagram of a higher priority stream is popped before the ones of a lower priority stream queued earlier, and
+// the RX routes every datagram to its stream's decoder, including the ones received in the first stream's buffers
+static bool test_mux_priority_and_demux()
+{
+    Mux::Descriptor descriptor;
+    Mux::TX_Stream_Descriptor data_stream;
+    data_stream.fec.coding_k = 2;
+    data_stream.fec.coding_n = 3;
+    data_stream.fec.is_synchronous = true;
+    descriptor.tx_streams.push_back(data_stream);
+    Mux::TX_Stream_Descriptor control_stream;
+    control_stream.priority = 1;
+    control_stream.fec.coding_k = 1;
+    control_stream.fec.coding_n = 1;
+    control_stream.fec.mtu = 64;
+    control_stream.fec.stream_id = 1;
+    control_stream.fec.is_synchronous = true;
+    descriptor.tx_streams.push_back(control_stream);
+
+    for (Mux::TX_Stream_Descriptor const& d: descriptor.tx_streams)
+    {
+        Fec_Encoder::RX_Descriptor rx_descriptor;
+        rx_descriptor.coding_k = d.fec.coding_k;
+        rx_descriptor.coding_n = d.fec.coding_n;
+        rx_descriptor.mtu = d.fec.mtu;
+        rx_descriptor.stream_id = d.fec.stream_id;
+        rx_descriptor.is_synchronous = true;
+        descriptor.rx_streams.push_back(rx_descriptor);
+    }
+
+    std::vector<uint8_t> decoded[2];
+    Mux mux;
+    mux.on_rx_data_decoded = [&decoded](uint8_t stream_id, void const* data, size_t size)
+    {
+        uint8_t const* d = reinterpret_cast<uint8_t const*>(data);
+        decoded[stream_id].insert(decoded[stream_id].end(), d, d + size);
+    };
+    CHECK(mux.init(descriptor));
+
+    std::vector<uint8_t> data(mux.get_tx_stream(0)->get_data_size() * 2, 0xAA);
+    CHECK(mux.add_tx_packet(0, data.data(), data.size(), true));
+    std::vector<uint8_t> control(mux.get_tx_stream(1)->get_data_size(), 0x55);
+    CHECK(mux.add_tx_packet(1, control.data(), control.size(), true));
+
+    std::vector<Fec_Encoder::Data_ptr> sent;
+    Fec_Encoder::Data_ptr datagram;
+    while (mux.pop_tx_datagram(datagram))
+    {
+        sent.push_back(datagram);
+    }
+    CHECK(sent.size() == 4);
+    uint8_t stream_id = 0;
+    CHECK(Fec_Encoder::get_stream_id(sent[0]->data(), sent[0]->size(), stream_id) && stream_id == 1);
+
+    for (Fec_Encoder::Data_ptr const& d: sent)
+    {
+        Fec_Encoder::RX_Buffer buffer;
+        CHECK(mux.acquire_rx_buffer(buffer));
+        size_t offset = 0;
+        for (iovec const& iov: buffer.iov)
+        {
+            size_t size = std::min(iov.iov_len, d->size() - offset);
+            memcpy(iov.iov_base, d->data() + offset, size);
+            offset += size;
+        }
+        CHECK(mux.add_rx_buffer(buffer, d->size(), true));
+    }
+    CHECK(decoded[0] == data);
+    CHECK(decoded[1] == control);
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+
+int main()
+{
+    struct Test
+    {
+        char const* name;
+        bool (*function)();
+    };
+    static const Test s_tests[] =
+    {
+        { "foreign_session_datagram", &test_foreign_session_datagram },
+        { "block_after_lost_block_released", &test_block_after_lost_block_released },
+        { "datagram_after_reset", &test_datagram_after_reset },
+        { "restarted_tx_session_switch", &test_restarted_tx_session_switch },
+        { "drop_oldest_not_spliced", &test_drop_oldest_not_spliced },
+        { "drop_oldest_interleaved_keeps_complete_blocks", &test_drop_oldest_interleaved_keeps_complete_blocks },
+        { "flushed_compressed_frame", &test_flushed_compressed_frame },
+        { "false_frame_header_not_waited_for", &test_false_frame_header_not_waited_for },
+        { "output_ring_outlives_encoder", &test_output_ring_outlives_encoder },
+        { "exclusive_with_late_copies", &test_exclusive_with_late_copies },
+        { "unordered_session_start_offsets", &test_unordered_session_start_offsets },
+        { "interleaved_burst_recovered", &test_interleaved_burst_recovered },
+        { "mixed_coding_params", &test_mixed_coding_params },
+        { "spread_fec_recovered", &test_spread_fec_recovered },
+        { "static_encoder_round_trip", &test_static_encoder_round_trip },
+        { "encrypted_tamper_rejected", &test_encrypted_tamper_rejected },
+        { "corrupted_datagram_dropped", &test_corrupted_datagram_dropped },
+        { "mux_priority_and_demux", &test_mux_priority_and_demux },
+    };
+
+    size_t failed = 0;
+    for (Test const& test: s_tests)
+    {
+        bool ok = test.function();
+        std::cout << (ok ? "[ OK ] " : "[FAIL] ") << test.name << "\n";
+        failed += ok ? 0 : 1;
+    }
+    std::cout << std::to_string(failed) << " failed\n";
+    return failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,50 @@
+#-------------------------------------------------
+#
+# Regression tests for the lib, run bin/fec_tests. Returns non zero if any test fails
+#
+#-------------------------------------------------
+
+TARGET = fec_tests
+TEMPLATE = app
+
+CONFIG -= qt
+CONFIG += c++11
+
+INCLUDEPATH += ../../../lib
+INCLUDEPATH += ../../../lib/utils
+
+QMAKE_CXXFLAGS += -Wno-unused-variable -Wno-unused-parameter
+
+CONFIG(debug, debug|release) {
+    DEST_FOLDER = pc/debug
+}
+CONFIG(release, debug|release) {
+    DEST_FOLDER = pc/release
+}
+
+LIBS += -lz -lpthread
+
+OBJECTS_DIR = ./.obj/$${DEST_FOLDER}
+DESTDIR = ../../bin
+
+HEADERS += \
+    ../../../lib/utils/fec.h \
+    ../../../lib/utils/chacha20_poly1305.h \
+    ../../../lib/utils/crc32c.h \
+    ../../../lib/Pool.h \
+    ../../../lib/Fec_Encoder.h \
+    ../../../lib/Static_Fec_Encoder.h \
+    ../../../lib/Compressor.h \
+    ../../../lib/Mux.h \
+    ../../../lib/Queue.h \
+    ../../../lib/Spsc_Ring.h \
+    ../../../lib/Spsc_Queue.h
+
+SOURCES += \
+    ../../fec_tests.cpp \
+    ../../../lib/utils/fec.cpp \
+    ../../../lib/utils/chacha20_poly1305.cpp \
+    ../../../lib/utils/crc32c.cpp \
+    ../../../lib/Fec_Encoder.cpp \
+    ../../../lib/Compressor.cpp \
+    ../../../lib/Mux.cpp